@@ -0,0 +1,732 @@
+#include "_.h"
+#include "listener.h"
+#include "loopgroup.h"
+#include "sockaddr.h"
+#include "stream.h"
+#include "timer.h"
+#include "log.h"
+#include "pool.h"
+#include "util.h"
+
+#include <sysexits.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+
+#define BENCH_MSG	"0123456789abcdef0123456789abcd\r\n"
+#define BENCH_HEAD	"HTTP/1.1 %d %s\r\nContent-Length: %zu\r\nX-Request-Id: %08x\r\nX-Elapsed: %.3f\r\n\r\n"
+
+struct bench {
+	const char *mode;
+	const char *backend;
+	const char *policy;
+	const char *pin;
+	int conns;
+	int count;
+	int threads;
+	int spin;
+	int depth;
+	int heavy;
+	int work;
+	int rebalance;
+	int stats;
+	int churn;
+	int ring;
+	int bulk;
+	uint16_t port;
+	sockaddr_t addr;
+	eventloop_t *loop;
+	loopgroup_t *group;
+	int ready;
+	int done;
+	int64_t start;
+};
+
+static struct bench B = {
+	.mode = "echo",
+	.backend = "epoll",
+	.policy = "rr",
+	.conns = 16,
+	.count = 0,
+	.threads = 1,
+	.depth = 1,
+	.bulk = 4 << 20,
+	.port = 8900
+};
+
+
+static uint8_t *bulk_body;
+
+
+static const struct eventpoll_ *bench_backend(const char *name) {
+	if (!strcmp(name, "uring")) {
+		return &eventpoll_uring;
+	}
+	return &eventpoll;
+}
+
+
+static void echo_processor(socket_t *sock, int why, void *ud) {
+	(void)ud;
+	uint32_t len;
+	char *line;
+
+	if (why & (EVMASK_ERROR | EVMASK_TIME)) {
+		socket_.enable(sock, 0);
+		close(sock->ev.fd);
+		socket_.free(sock);
+		return;
+	}
+	while ((line = stream.yield(sock->istm, "\r\n", 2, &len))) {
+		if (line[0] == 'H') {
+			int64_t until = timer.usec() + B.work;
+			while (timer.usec() < until) {}
+		}
+		if (bulk_body) {
+			stream.write(sock->ostm, bulk_body, B.bulk, 0);
+			continue;
+		}
+		stream.write(sock->ostm, line, len, 0);
+	}
+	socket_.flush(sock);
+}
+
+
+static void use_ring(socket_t *sock) {
+	if (B.ring && (stream.set_ring(sock->istm, B.ring) || stream.set_ring(sock->ostm, B.ring))) {
+		logger.err("bench ring: %s\n", strerror(errno));
+	}
+}
+
+
+static void echo_acceptor(listener_t *lstn, socket_t *sock) {
+	use_ring(sock);
+	sock->cb = echo_processor;
+	sock->ev.label = "echo";
+	sock->loop = listener.loop(lstn);
+	sock->timeout = 0;
+	socket_.enable(sock, 1);
+}
+
+
+static void print_hist(const char *name, const histogram_t *h) {
+	printf("  %-10s n %-8" PRIu64 " mean %-6" PRIu64 " p50 %-6" PRIu64 " p99 %-6" PRIu64 " max %" PRIu64 "\n",
+			name, histogram.count(h), histogram.mean(h), histogram.percentile(h, 50),
+			histogram.percentile(h, 99), histogram.highest(h));
+}
+
+
+static void print_stats(eventloop_t *loop) {
+	eventloop_stats_t *st = loop->stats;
+	char name[32];
+	int i;
+
+	printf("loop: %" PRIu64 " iterations, %" PRIu64 " wakeups, %" PRIu64 " dispatches, times in us\n",
+			st->iterations, st->wakeups, st->dispatches);
+	print_hist("blocked", &st->blocked);
+	print_hist("batch", &st->batch);
+	print_hist("pending", &st->pending);
+	print_hist("iteration", &st->iteration);
+	for (i = 0; i < EVENTLOOP_STAT_LABELS && st->labels[i].key; i++) {
+		if (st->labels[i].label) {
+			snprintf(name, sizeof name, "%s", st->labels[i].label);
+		} else {
+			snprintf(name, sizeof name, "cb#%d", i);
+		}
+		print_hist(name, &st->labels[i].dispatch);
+	}
+}
+
+
+static void print_pool(void) {
+	pool_stats_t st;
+
+	pool.stats(&st);
+	printf("pool: %" PRIu64 " gets, %.1f%% hits, %" PRIu64 " local puts, %" PRIu64 " remote puts, %" PRIu64 " bytes cached\n",
+			st.gets, st.gets ? (double)st.hits * 100 / st.gets : 0.0, st.puts, st.remote, st.cached);
+}
+
+
+/* User and system time of the calling thread in us, the loop of a
+ * single threaded echo runs on the main thread. */
+static void thread_cpu(int64_t *user, int64_t *sys) {
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);
+	*user = ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec;
+	*sys = ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+}
+
+
+/* Each roundtrip pipelines B.depth messages in one write, messages of
+ * heavy connections cost B.work usec on the server. In bulk mode every
+ * message is answered with B.bulk bytes, more than the socket buffers
+ * hold, so the server finishes each response on write readiness. */
+static int echo_roundtrip(int fd, int heavy) {
+	char buf[1 << 16];
+	size_t msglen = (sizeof(BENCH_MSG) - 1) * B.depth;
+	size_t want = bulk_body ? (size_t)B.bulk * B.depth : msglen;
+	size_t got = 0;
+	int i;
+
+	for (i = 0; i < B.depth; i++) {
+		memcpy(buf + i * (sizeof(BENCH_MSG) - 1), BENCH_MSG, sizeof(BENCH_MSG) - 1);
+		if (heavy) {
+			buf[i * (sizeof(BENCH_MSG) - 1)] = 'H';
+		}
+	}
+	if (write(fd, buf, msglen) != (ssize_t)msglen) {
+		return -1;
+	}
+	while (got < want) {
+		ssize_t n = read(fd, buf, sizeof buf);
+		if (n <= 0) {
+			return -1;
+		}
+		got += n;
+	}
+	return 0;
+}
+
+
+static void handoff_acceptor(listener_t *lstn, socket_t *sock) {
+	(void)lstn;
+	use_ring(sock);
+	sock->cb = echo_processor;
+	sock->timeout = 0;
+	loopgroup.handoff(B.group, sock);
+}
+
+
+static int bench_policy(const char *name) {
+	if (!strcmp(name, "conn")) {
+		return LOOPGROUP_LEASTCONN;
+	} else if (!strcmp(name, "lat")) {
+		return LOOPGROUP_LATENCY;
+	}
+	return LOOPGROUP_ROUNDROBIN;
+}
+
+
+static int bench_pin(const char *name) {
+	if (name && !strcmp(name, "cpu")) {
+		return LOOPGROUP_PIN_CPU;
+	} else if (name && !strcmp(name, "node")) {
+		return LOOPGROUP_PIN_NODE;
+	}
+	return LOOPGROUP_PIN_NONE;
+}
+
+
+static int echo_connect(void) {
+	int fd = socket_.for_addr(&B.addr, SOCK_STREAM, SOCK_CLOEXEC);
+	if (fd != -1 && connect(fd, &B.addr.sa.sa, sockaddr.len(&B.addr))) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+
+/* Clients connect one by one and start together, so connection setup
+ * is kept out of the measured window. With churn every message is sent
+ * on a new connection. */
+static void *echo_client(void *ud) {
+	int i, fd, id = (intptr_t)ud;
+
+	while (SYNC_GET(B.ready) != id) {
+		usleep(100);
+	}
+	fd = echo_connect();
+	if (fd == -1 || echo_roundtrip(fd, 0)) {
+		logger.err("bench connect: %s\n", strerror(errno));
+		exit(EX_UNAVAILABLE);
+	}
+	if (__sync_add_and_fetch(&B.ready, 1) == B.conns) {
+		B.start = timer.now();
+	}
+	while (SYNC_GET(B.ready) != B.conns) {}
+
+	for (i = 0; i < B.count; i++) {
+		if (B.churn) {
+			close(fd);
+			fd = echo_connect();
+		}
+		if (fd == -1 || echo_roundtrip(fd, id < B.heavy)) {
+			break;
+		}
+	}
+	if (fd != -1) {
+		close(fd);
+	}
+	if (__sync_add_and_fetch(&B.done, 1) == B.conns && B.loop) {
+		eventloop.exit(B.loop);
+	}
+	return 0;
+}
+
+
+static int bench_echo(void) {
+	listener_t *lstn = 0;
+	loopgroup_t *group = 0;
+	listener_accept_pt acceptor = echo_acceptor;
+	pthread_t *tids;
+	int64_t elapsed, user = 0, sys = 0, user1 = 0, sys1 = 0;
+	int i;
+
+	if (!strcmp(B.mode, "churn")) {
+		B.churn = 1;
+	}
+	if (!strcmp(B.mode, "bulk")) {
+		bulk_body = alloc(0, B.bulk);
+		memset(bulk_body, 'x', B.bulk);
+	}
+	if (!strcmp(B.mode, "handoff")) {
+		B.group = group = loopgroup.new_pinned("bench", B.threads, bench_backend(B.backend), bench_pin(B.pin));
+		if (!group) {
+			logger.err("bench group: %s\n", strerror(errno));
+			return EX_UNAVAILABLE;
+		}
+		loopgroup.set_policy(group, bench_policy(B.policy));
+		acceptor = handoff_acceptor;
+	}
+	if (!strcmp(B.mode, "shared")) {
+		group = loopgroup.new_shared("bench", B.threads);
+		if (!group || loopgroup.listen(group, &B.addr, echo_acceptor)) {
+			logger.err("bench group: %s\n", strerror(errno));
+			return EX_UNAVAILABLE;
+		}
+	} else if (!group && B.threads > 1) {
+		group = loopgroup.new_pinned("bench", B.threads, bench_backend(B.backend), bench_pin(B.pin));
+		if (!group || loopgroup.listen(group, &B.addr, echo_acceptor)) {
+			logger.err("bench group: %s\n", strerror(errno));
+			return EX_UNAVAILABLE;
+		}
+	} else {
+		B.loop = eventloop.new_backend(bench_backend(B.backend));
+		if (!B.loop) {
+			logger.err("backend %s unavailable: %s\n", B.backend, strerror(errno));
+			return EX_UNAVAILABLE;
+		}
+		lstn = listener.new("bench", B.loop, acceptor);
+		eventloop.busy_poll(B.loop, B.spin);
+		if (B.stats) {
+			eventloop.stats(B.loop, 1);
+		}
+		listener.set_busy_poll(lstn, B.spin);
+		if (listener.bind(lstn, &B.addr) || listener.enable(lstn, 1)) {
+			logger.err("bench listen: %s\n", strerror(errno));
+			return EX_UNAVAILABLE;
+		}
+	}
+
+	if (group && B.rebalance && loopgroup.rebalance(group, B.rebalance)) {
+		logger.err("bench rebalance: %s\n", strerror(errno));
+	}
+
+	tids = alloc(0, B.conns * sizeof *tids);
+	for (i = 0; i < B.conns; i++) {
+		pthread_create(&tids[i], 0, echo_client, (void *)(intptr_t)i);
+	}
+	if (B.loop) {
+		thread_cpu(&user, &sys);
+		eventloop.loop(B.loop);
+		thread_cpu(&user1, &sys1);
+	}
+	for (i = 0; i < B.conns; i++) {
+		pthread_join(tids[i], 0);
+	}
+	elapsed = max(timer.now() - B.start, 1);
+
+	printf("%s %s x %d: %d conns x %d msgs x %d deep in %" PRId64 " ms, %.0f msg/s\n",
+			B.mode, B.backend, B.threads, B.conns, B.count, B.depth, elapsed,
+			(double)B.conns * B.count * B.depth * 1000 / elapsed);
+	if (bulk_body) {
+		printf("bulk: %d bytes per response, %.0f MB/s\n",
+				B.bulk, (double)B.conns * B.count * B.depth * B.bulk / 1000 / elapsed);
+	}
+	if (B.loop && !B.group) {
+		printf("loop cpu: %.2f us user, %.2f us sys per msg\n",
+				(double)(user1 - user) / ((double)B.conns * B.count * B.depth),
+				(double)(sys1 - sys) / ((double)B.conns * B.count * B.depth));
+	}
+	if (B.loop && B.stats) {
+		print_stats(B.loop);
+	}
+	if (B.churn || B.stats) {
+		print_pool();
+	}
+	if (B.loop && B.spin) {
+		printf("busy poll %d us: %" PRIu64 " spin hits, %" PRIu64 " blocking waits\n",
+				B.spin, B.loop->spin_hits, B.loop->blocks);
+	}
+
+	alloc(tids, 0);
+	alloc(bulk_body, 0);
+	if (group) {
+		loopgroup.free(group);
+	}
+	if (lstn) {
+		listener.free(lstn);
+		eventloop.free(B.loop);
+	}
+	return 0;
+}
+
+
+/* Every connection echoes one message and then sits idle, the growth of
+ * the resident set is what the server keeps per idle connection. */
+static void *idle_client(void *ud) {
+	int i, *fds = ud, rss = util.mem_used();
+	pool_stats_t st;
+
+	for (i = 0; i < B.conns; i++) {
+		fds[i] = echo_connect();
+		if (fds[i] == -1 || echo_roundtrip(fds[i], 0)) {
+			logger.err("bench connect %d: %s\n", i, strerror(errno));
+			exit(EX_UNAVAILABLE);
+		}
+	}
+	rss = util.mem_used() - rss;
+	pool.stats(&st);
+	printf("idle: %d conns, %d KiB resident, %.0f bytes per idle connection, %" PRIu64 " bytes cached by the pool\n",
+			B.conns, rss, (double)rss * 1024 / B.conns, st.cached);
+	for (i = 0; i < B.conns; i++) {
+		close(fds[i]);
+	}
+	eventloop.exit(B.loop);
+	return 0;
+}
+
+
+static int bench_idle(void) {
+	listener_t *lstn;
+	pthread_t tid;
+	int *fds;
+
+	if (util.fd_limit(B.conns * 2 + 64) < B.conns * 2 + 64) {
+		logger.err("bench idle: too many connections for the fd limit\n");
+		return EX_UNAVAILABLE;
+	}
+	B.loop = eventloop.new_backend(bench_backend(B.backend));
+	if (!B.loop) {
+		logger.err("backend %s unavailable: %s\n", B.backend, strerror(errno));
+		return EX_UNAVAILABLE;
+	}
+	lstn = listener.new("bench", B.loop, echo_acceptor);
+	if (listener.bind(lstn, &B.addr) || listener.enable(lstn, 1)) {
+		logger.err("bench listen: %s\n", strerror(errno));
+		return EX_UNAVAILABLE;
+	}
+	fds = alloc(0, B.conns * sizeof *fds);
+	pthread_create(&tid, 0, idle_client, fds);
+	eventloop.loop(B.loop);
+	pthread_join(tid, 0);
+	alloc(fds, 0);
+	listener.free(lstn);
+	eventloop.free(B.loop);
+	return 0;
+}
+
+
+static struct eventpoll_ counting_backend;
+static int wakeups;
+
+static void counting_wakeup(eventpoll_t *poll) {
+	__sync_add_and_fetch(&wakeups, 1);
+	eventpoll.wakeup(poll);
+}
+
+
+static void nop_cb(eventloop_t *loop, event_t *ev) {
+	(void)loop;
+	(void)ev;
+}
+
+
+static void *apply_loop(void *ud) {
+	eventloop_t *loop = ud;
+	loop->me = thread.self();
+	(void)SYNC_SET(B.ready, 1);
+	eventloop.loop(loop);
+	return 0;
+}
+
+
+static void *apply_producer(void *ud) {
+	event_t *ev = ud;
+	int i;
+	for (i = 0; i < B.count; i++) {
+		eventloop.apply(B.loop, ev);
+	}
+	return 0;
+}
+
+
+static void clock_cost(const char *name, int64_t (*fn)(void)) {
+	int64_t start = timer.nsec();
+	int i;
+
+	for (i = 0; i < B.count; i++) {
+		fn();
+	}
+	printf("clock: %-7s %5.1f ns/call\n", name, (double)(timer.nsec() - start) / max(B.count, 1));
+}
+
+
+static int64_t loop_now(void) {
+	return eventloop.now(B.loop);
+}
+
+
+static int bench_clock(void) {
+	B.loop = eventloop.new();
+	clock_cost("now", timer.now);
+	clock_cost("usec", timer.usec);
+	clock_cost("nsec", timer.nsec);
+	clock_cost("coarse", timer.coarse);
+	clock_cost("loop", loop_now);
+	if (timer.tsc(1)) {
+		printf("clock: no invariant tsc\n");
+	} else {
+		clock_cost("tsc", timer.nsec);
+		timer.tsc(0);
+	}
+	eventloop.free(B.loop);
+	return 0;
+}
+
+
+static fmt_t *head_fmt;
+
+
+/* What buffer.printf cost before fmt, vsnprintf into the tail. */
+static uint32_t head_snprintf(buffer_t *buf, int i) {
+	int n;
+	buffer.extend(buf, 256);
+	n = snprintf((char *)buffer.wpos(buf), buffer.space(buf), BENCH_HEAD, 200, "OK", (size_t)i * 7, (unsigned)i, i / 1000.0);
+	return buffer.write(buf, 0, n);
+}
+
+
+static uint32_t head_printf(buffer_t *buf, int i) {
+	return buffer.printf(buf, BENCH_HEAD, 200, "OK", (size_t)i * 7, (unsigned)i, i / 1000.0);
+}
+
+
+static uint32_t head_format(buffer_t *buf, int i) {
+	return buffer.format(buf, head_fmt, 200, "OK", (size_t)i * 7, (unsigned)i, i / 1000.0);
+}
+
+
+static void fmt_cost(const char *name, uint32_t (*fn)(buffer_t *, int)) {
+	buffer_t *buf = buffer.new(0);
+	int64_t start = timer.nsec();
+	uint64_t bytes = 0;
+	int i;
+
+	for (i = 0; i < B.count; i++) {
+		bytes += fn(buf, i);
+		if (buffer.avail(buf) > (1 << 16)) {
+			buffer.read(buf, 0, buffer.avail(buf));
+		}
+	}
+	printf("fmt: %-8s %5.1f ns/call, %" PRIu64 " bytes\n", name, (double)(timer.nsec() - start) / max(B.count, 1), bytes);
+	buffer.free(buf);
+}
+
+
+static int bench_fmt(void) {
+	head_fmt = fmt.new(BENCH_HEAD);
+	fmt_cost("snprintf", head_snprintf);
+	fmt_cost("printf", head_printf);
+	fmt_cost("format", head_format);
+	fmt.free(head_fmt);
+	return 0;
+}
+
+
+/* One 1M line arriving in 8K reads, yield is called after each read,
+ * then short request lines ending in the head segment. */
+static int bench_yield(void) {
+	static uint8_t chunk[8192];
+	const char *req = "GET /index.html HTTP/1.1\r\nHost: example.com\r\nAccept: */*\r\n\r\n";
+	buffer_t *buf = buffer.new(0);
+	uint64_t lines = 0;
+	uint32_t len;
+	int64_t start;
+	int i;
+
+	memset(chunk, 'x', sizeof chunk);
+	start = timer.nsec();
+	for (i = 0; i < (1 << 20) / (int)sizeof chunk; i++) {
+		buffer.write(buf, chunk, sizeof chunk);
+		buffer.yield(buf, "\r\n", 2, &len);
+	}
+	buffer.write(buf, "\r\n", 2);
+	if (!buffer.yield(buf, "\r\n", 2, &len)) {
+		fprintf(stderr, "yield: line not found\n");
+		return 1;
+	}
+	printf("yield: long  %8.1f us, 1M line in 8K reads\n", (double)(timer.nsec() - start) / 1000);
+
+	start = timer.nsec();
+	for (i = 0; i < B.count; i++) {
+		buffer.write(buf, req, strlen(req));
+		while (buffer.yield(buf, "\r\n", 2, &len)) {
+			lines++;
+		}
+	}
+	printf("yield: short %8.1f ns/line\n", (double)(timer.nsec() - start) / max(lines, 1));
+	buffer.free(buf);
+	return 0;
+}
+
+
+/* Cross-thread eventloop.apply contention, 1 to 32 producers. */
+static int bench_apply(void) {
+	pthread_t tids[32];
+	event_t evs[32];
+	thread_t *thrd;
+	int i, p;
+
+	counting_backend = eventpoll;
+	counting_backend.wakeup = counting_wakeup;
+	B.loop = eventloop.new_backend(&counting_backend);
+	for (i = 0; i < 32; i++) {
+		event.init(&evs[i], eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), EVMASK_READ, nop_cb, 0);
+	}
+	thrd = thread.new("apply", apply_loop, B.loop);
+	while (!SYNC_GET(B.ready)) {}
+
+	for (p = 1; p <= 32; p *= 2) {
+		int64_t start = timer.usec(), elapsed;
+		(void)SYNC_SET(wakeups, 0);
+		for (i = 0; i < p; i++) {
+			pthread_create(&tids[i], 0, apply_producer, &evs[i]);
+		}
+		for (i = 0; i < p; i++) {
+			pthread_join(tids[i], 0);
+		}
+		while (!mpsc.empty(&B.loop->pandings)) {}
+		elapsed = max(timer.usec() - start, 1);
+		printf("apply: %2d producers x %d in %" PRId64 " us, %.2f M/s, %d wakeups\n",
+				p, B.count, elapsed, (double)p * B.count / elapsed, SYNC_GET(wakeups));
+	}
+
+	eventloop.exit(B.loop);
+	thread.join(thrd, 0);
+	for (i = 0; i < 32; i++) {
+		close(evs[i].fd);
+	}
+	eventloop.free(B.loop);
+	return 0;
+}
+
+
+int main(int argc, char *argv[]) {
+	int c;
+
+	while ((c = getopt(argc, argv, "m:b:P:a:c:n:d:H:w:R:r:l:t:s:Sp:")) != -1) {
+		switch (c) {
+			case 'm':
+				B.mode = optarg;
+				break;
+			case 'b':
+				B.backend = optarg;
+				break;
+			case 'P':
+				B.policy = optarg;
+				break;
+			case 'a':
+				B.pin = optarg;
+				break;
+			case 'c':
+				B.conns = atoi(optarg);
+				break;
+			case 'n':
+				B.count = atoi(optarg);
+				break;
+			case 'd':
+				B.depth = max(1, min(atoi(optarg), 64));
+				break;
+			case 'H':
+				B.heavy = atoi(optarg);
+				break;
+			case 'w':
+				B.work = atoi(optarg);
+				break;
+			case 'R':
+				B.rebalance = atoi(optarg);
+				break;
+			case 'r':
+				B.ring = atoi(optarg);
+				break;
+			case 'l':
+				B.bulk = atoi(optarg);
+				break;
+			case 't':
+				B.threads = atoi(optarg);
+				break;
+			case 's':
+				B.spin = atoi(optarg);
+				break;
+			case 'S':
+				B.stats = 1;
+				break;
+			case 'p':
+				B.port = atoi(optarg);
+				break;
+			default:
+				fprintf(stderr,
+						"Usage: bench [-m MODE] [-b BACKEND] [-P POLICY] [-a PIN] [-c CONNS] [-n COUNT] [-d DEPTH] [-H HEAVY] [-w USEC] [-R MS] [-r BYTES] [-l BYTES] [-t THREADS] [-s USEC] [-S] [-p PORT]\n"
+						" -m MODE     - echo, churn, bulk, handoff, shared, idle, apply, clock, fmt or yield\n"
+						" -b BACKEND  - epoll or uring\n"
+						" -P POLICY   - handoff placement: rr, conn or lat\n"
+						" -a PIN      - pin group loops to a cpu or node\n"
+						" -c CONNS    - concurrent client connections\n"
+						" -n COUNT    - messages per connection, 100 in bulk and 20000 else\n"
+						" -d DEPTH    - messages pipelined per write, up to 64\n"
+						" -H HEAVY    - connections sending heavy messages\n"
+						" -w USEC     - server cpu time of a heavy message\n"
+						" -R MS       - rebalance period of a group, 0 disable\n"
+						" -r BYTES    - ring buffers of the server streams, 0 chained\n"
+						" -l BYTES    - response size of bulk, 4 MiB by default\n"
+						" -t THREADS  - worker threads\n"
+						" -s USEC     - busy poll window of a single loop\n"
+						" -S          - print the stats of a single loop\n"
+						" -p PORTNO   - which port to listen on\n"
+					  );
+				exit(EX_USAGE);
+		}
+	}
+
+	if (!B.count) {
+		B.count = strcmp(B.mode, "bulk") ? 20000 : 100;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	thread.init();
+	sockaddr.v4(&B.addr, "127.0.0.1", B.port);
+
+	if (!strcmp(B.mode, "echo") || !strcmp(B.mode, "churn") || !strcmp(B.mode, "bulk") || !strcmp(B.mode, "handoff") || !strcmp(B.mode, "shared")) {
+		return bench_echo();
+	} else if (!strcmp(B.mode, "idle")) {
+		return bench_idle();
+	} else if (!strcmp(B.mode, "apply")) {
+		return bench_apply();
+	} else if (!strcmp(B.mode, "clock")) {
+		return bench_clock();
+	} else if (!strcmp(B.mode, "fmt")) {
+		return bench_fmt();
+	} else if (!strcmp(B.mode, "yield")) {
+		return bench_yield();
+	}
+	fprintf(stderr, "unknown mode %s\n", B.mode);
+	return EX_USAGE;
+}
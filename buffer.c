@@ -1,167 +1,983 @@
 ﻿#include "_.h"
 #include "buffer.h"
+#include "pool.h"
 
-struct _buffer {
-	uint8_t *buf;
+#include <sys/mman.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define BUF_AVX2	1
+#endif
+
+#define BUF_KEY		24
+
+/* Segments past the tail are reserved by wvec until the next commit.
+ * A segment of a slice points into it and is never the tail, so writes
+ * can't reach shared bytes. The data of an own segment follows it. */
+typedef struct _seg {
+	struct _seg *next;
+	uint8_t *base;
+	slice_t *slice;
 	uint32_t size;
 	uint32_t rpos;
 	uint32_t wpos;
+} seg_t;
+
+#define SEG_DATA(seg)	((uint8_t *)((seg) + 1))
+
+struct _slice {
+	uint32_t ref;
+	uint32_t len;
+	uint8_t data[];
 };
 
+struct _buffer {
+	seg_t *head, *tail;
+	seg_t *spare;		/* consumed segments, reused by the next write. */
+	seg_t *parked;		/* consumed segments of slices, freed with the spares. */
+	seg_t idle;			/* the empty segment of a buffer without memory. */
+	uint32_t avail;
+	uint32_t low, cap;	/* segment size limits. */
+	uint32_t hint;		/* average burst, the bytes held before going empty. */
+	uint32_t peak;		/* bytes held in the current burst. */
+	uint32_t grow;		/* size of the next new segment of the burst. */
+	uint32_t ring;		/* capacity of a ring, 0 for a chain. */
+	uint32_t scan;		/* readable bytes yield found no delimiter start in. */
+	uint8_t key[BUF_KEY];	/* the delimiters scan is for. */
+};
+
+typedef struct _delims {
+	const uint8_t *d[BUF_DELIMS];
+	uint32_t len[BUF_DELIMS];
+	int n;
+	uint32_t maxlen;
+	uint8_t first[BUF_DELIMS];
+	int nfirst;
+	uint8_t key[BUF_KEY];
+} delims_t;
+
+
+/* The smallest power of two times low covering the hint. */
+static uint32_t target(buffer_t *buf) {
+	uint32_t size = buf->low;
+	while (size < buf->hint && size < buf->cap) {
+		size <<= 1;
+	}
+	return min(size, buf->cap);
+}
+
+
+/* Sizes are footprints, header included, rounded up to a pool class. */
+static seg_t *seg_new(buffer_t *buf, uint32_t size) {
+	seg_t *seg = buf->spare;
+	if (seg && sizeof *seg + seg->size >= size) {
+		buf->spare = seg->next;
+	} else {
+		seg = pool.get(size);
+		if (!seg) {
+			return 0;
+		}
+		seg->size = pool.size(seg) - sizeof *seg;
+		seg->base = SEG_DATA(seg);
+		seg->slice = 0;
+	}
+	seg->next = 0;
+	seg->rpos = 0;
+	seg->wpos = 0;
+	return seg;
+}
+
+
+static slice_t *slice_ref(slice_t *sl);
+static void slice_unref(slice_t *sl);
+
+static void seg_free(seg_t *seg) {
+	if (seg->slice) {
+		slice_unref(seg->slice);
+	}
+	pool.put(seg);
+}
+
+
+static void seg_release(buffer_t *buf, seg_t *seg) {
+	if (seg == &buf->idle) {
+		return;
+	}
+	if (seg->slice) {
+		seg->next = buf->parked;
+		buf->parked = seg;
+		return;
+	}
+	seg->next = buf->spare;
+	buf->spare = seg;
+}
+
+
+/* One spare is kept for the next segment, the others and the parked
+ * slices are freed. */
+static void trim_spare(buffer_t *buf, int keep) {
+	seg_t **pseg = &buf->spare, *seg;
+
+	while ((seg = buf->parked)) {
+		buf->parked = seg->next;
+		seg_free(seg);
+	}
+	while ((seg = *pseg)) {
+		if (keep > 0) {
+			keep--;
+			pseg = &seg->next;
+			continue;
+		}
+		*pseg = seg->next;
+		pool.put(seg);
+	}
+}
+
 
 static buffer_t *buffer_new(uint32_t size) {
 	buffer_t *buf;
 
-	buf = alloc(0, sizeof *buf);
+	buf = pool.alloc(sizeof *buf);
 	if (!buf) {
 		return 0;
 	}
-	if (size == 0) {
-		buf->size = 1 << BUF_SIZE_P;
+	buf->hint = size ? size : 1 << BUF_SIZE_P;
+	buf->low = min(buf->hint, 1 << BUF_LOW_P);
+	buf->cap = max(buf->hint, 1 << BUF_CAP_P);
+	buf->grow = buf->hint;
+	buf->idle.base = SEG_DATA(&buf->idle);
+	buf->head = buf->tail = &buf->idle;
+	return buf;
+}
+
+
+/* A ring is one segment over a region mapped twice back to back, the
+ * bytes past it's end are the ones at the start, so the readable and the
+ * writable part are always contiguous. seg->size is rpos + ring, the end
+ * of the writable part. */
+static buffer_t *buffer_new_ring(uint32_t size) {
+#ifdef HAVE_MEMFD_CREATE
+	size_t page = sysconf(_SC_PAGESIZE), cap = (size + page - 1) / page * page;
+	buffer_t *buf;
+	uint8_t *base;
+	seg_t *seg;
+	int fd;
+
+	if (size == 0 || cap > (1U << 30)) {
+		errno = EINVAL;
+		return 0;
+	}
+	fd = memfd_create("buffer", MFD_CLOEXEC);
+	if (fd == -1) {
+		return 0;
 	}
-	buf->buf = alloc(0, buf->size);
-	if (!buf->buf) {
-		alloc(buf, 0);
+	base = ftruncate(fd, cap) ? MAP_FAILED : mmap(0, cap * 2, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (base != MAP_FAILED &&
+			(mmap(base, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED ||
+			 mmap(base + cap, cap, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)) {
+		munmap(base, cap * 2);
+		base = MAP_FAILED;
+	}
+	close(fd);
+	if (base == MAP_FAILED) {
 		return 0;
 	}
-	buf->rpos = 0;
-	buf->wpos = 0;
-
+	buf = pool.alloc(sizeof *buf);
+	seg = pool.get(sizeof *seg);
+	if (!buf || !seg) {
+		pool.put(buf);
+		pool.put(seg);
+		munmap(base, cap * 2);
+		errno = ENOMEM;
+		return 0;
+	}
+	memset(seg, 0, sizeof *seg);
+	seg->base = base;
+	seg->size = cap;
+	buf->head = buf->tail = seg;
+	buf->ring = buf->low = buf->cap = buf->hint = buf->grow = cap;
 	return buf;
+#else
+	(void)size;
+	errno = ENOTSUP;
+	return 0;
+#endif
+}
+
+
+static void ring_moved(buffer_t *buf, seg_t *seg) {
+	if (seg->rpos == seg->wpos) {
+		seg->rpos = seg->wpos = 0;
+	} else if (seg->rpos >= buf->ring) {
+		seg->rpos -= buf->ring;
+		seg->wpos -= buf->ring;
+	}
+	seg->size = seg->rpos + buf->ring;
 }
 
 
 static void buffer_free(buffer_t *buf) {
-	alloc(buf->buf, 0);
-	alloc(buf, 0);
+	seg_t *seg, *next;
+	if (buf->ring) {
+		munmap(buf->head->base, (size_t)buf->ring * 2);
+		pool.put(buf->head);
+		pool.put(buf);
+		return;
+	}
+	for (seg = buf->head; seg; seg = next) {
+		next = seg->next;
+		if (seg != &buf->idle) {
+			seg_free(seg);
+		}
+	}
+	trim_spare(buf, 0);
+	pool.put(buf);
 }
 
 
-static int buffer_extend(buffer_t *buf, uint32_t len) {
-	if (buf->rpos > 0) {
-		memmove(buf->buf, buf->buf + buf->rpos, buf->wpos - buf->rpos);
-		buf->wpos -= buf->rpos;
-		buf->rpos = 0;
-		if (buf->wpos + len <= buf->size) {
-			return 0;
+/* Fully read segments go to the spare list, the memory of the last one
+ * stays valid until the next write like the single buffer it replaced.
+ * Read slices are parked as long, yield may have returned their bytes. */
+static void consume(buffer_t *buf, uint32_t n) {
+	buf->avail -= n;
+	buf->scan = buf->scan > n ? buf->scan - n : 0;
+	for (;;) {
+		seg_t *seg = buf->head;
+		uint32_t k = min(n, seg->wpos - seg->rpos);
+		seg->rpos += k;
+		n -= k;
+		if (buf->ring) {
+			ring_moved(buf, seg);
+			break;
 		}
+		if (seg->rpos < seg->wpos) {
+			break;
+		}
+		if (seg == buf->tail) {
+			seg->rpos = seg->wpos = 0;
+			break;
+		}
+		buf->head = seg->next;
+		seg_release(buf, seg);
 	}
-	uint32_t newlen = buf->wpos + len;
-	uint8_t *mem = alloc(buf->buf, newlen);
-	if (!mem) {
+	if (buf->avail == 0 && buf->peak) {
+		buf->hint = (buf->hint * 3 + buf->peak) / 4;
+		buf->peak = 0;
+		buf->grow = target(buf);
+	}
+}
+
+
+static void grown(buffer_t *buf) {
+	buf->peak = max(buf->peak, buf->avail);
+	buf->grow = min(buf->grow * 2, buf->cap);
+}
+
+
+/* Commit n bytes written to the space returned by wvec or wpos, the
+ * reserved segments left empty go back to the spare list. */
+static void commit(buffer_t *buf, uint32_t n) {
+	seg_t *seg = buf->tail, *next;
+
+	buf->avail += n;
+	buf->peak = max(buf->peak, buf->avail);
+	for (;;) {
+		uint32_t k = min(n, seg->size - seg->wpos);
+		seg->wpos += k;
+		n -= k;
+		if (!n || !seg->next) {
+			break;
+		}
+		seg = seg->next;
+	}
+	if (buf->tail != seg) {
+		grown(buf);
+	}
+	buf->tail = seg;
+	next = seg->next;
+	seg->next = 0;
+	while ((seg = next)) {
+		next = seg->next;
+		seg_release(buf, seg);
+	}
+	trim_spare(buf, 1);
+}
+
+
+/* Append a segment of at least len bytes, in place of an empty tail.
+ * Segments of a burst double in size up to the cap. */
+static int link_seg(buffer_t *buf, uint32_t len) {
+	seg_t *seg, *prev, *next;
+
+	if (buf->ring) {
+		errno = ENOBUFS;
 		return -1;
 	}
-	buf->size = newlen;
-	buf->buf = mem;
+	seg = seg_new(buf, max(sizeof *seg + len, buf->grow));
+	if (!seg) {
+		return -1;
+	}
+	if (buf->avail == 0) {
+		for (prev = buf->head; prev; prev = next) {
+			next = prev->next;
+			seg_release(buf, prev);
+		}
+		buf->head = seg;
+	} else if (buf->tail->wpos == buf->tail->rpos) {
+		for (prev = buf->head; prev->next != buf->tail; prev = prev->next) {}
+		seg_release(buf, buf->tail);
+		prev->next = seg;
+	} else {
+		buf->tail->next = seg;
+	}
+	buf->tail = seg;
+	grown(buf);
 	return 0;
 }
 
 
-static uint32_t buffer_read(buffer_t *buf, void *mem, uint32_t len) {
-	uint32_t nread = min(len, buf->wpos - buf->rpos);
-	if (nread) {
-		if (mem) {
-			memmove(mem, buf->buf + buf->rpos, nread);
+/* Existing bytes never move: a tail too small for len is followed by a
+ * new segment, only an empty buffer resets or replaces its segment. */
+static int buffer_extend(buffer_t *buf, uint32_t len) {
+	seg_t *tail = buf->tail;
+	if (tail->size - tail->wpos >= len) {
+		return 0;
+	}
+	if (buf->avail == 0 && tail->size >= len) {
+		tail->rpos = tail->wpos = 0;
+		return 0;
+	}
+	return link_seg(buf, len);
+}
+
+
+static int buffer_rehome(buffer_t *buf) {
+	seg_t **pseg = &buf->head, *seg, *copy;
+
+	if (buf->ring) {
+		return 0;
+	}
+	while ((seg = *pseg)) {
+		if (seg->slice || seg == &buf->idle) {
+			pseg = &seg->next;
+			continue;
+		}
+		copy = pool.get(sizeof *copy + seg->size);
+		if (!copy) {
+			return -1;
+		}
+		copy->size = pool.size(copy) - sizeof *copy;
+		copy->base = SEG_DATA(copy);
+		copy->slice = 0;
+		copy->rpos = 0;
+		copy->wpos = seg->wpos - seg->rpos;
+		copy->next = seg->next;
+		memcpy(copy->base, seg->base + seg->rpos, copy->wpos);
+		if (buf->tail == seg) {
+			buf->tail = copy;
+		}
+		*pseg = copy;
+		pseg = &copy->next;
+		pool.put(seg);
+	}
+	trim_spare(buf, 0);
+	return 0;
+}
+
+
+/* Gather every readable byte into a single segment. */
+static uint8_t *linearize(buffer_t *buf) {
+	seg_t *seg, *next, *one;
+
+	if (buf->head == buf->tail || buf->head->wpos - buf->head->rpos == buf->avail) {
+		return buf->head->base + buf->head->rpos;
+	}
+	one = seg_new(buf, sizeof *one + buf->avail + buf->grow);
+	if (!one) {
+		return 0;
+	}
+	for (seg = buf->head; seg; seg = next) {
+		next = seg->next;
+		memcpy(one->base + one->wpos, seg->base + seg->rpos, seg->wpos - seg->rpos);
+		one->wpos += seg->wpos - seg->rpos;
+		seg_release(buf, seg);
+	}
+	buf->head = buf->tail = one;
+	return one->base;
+}
+
+
+/* The segments of an empty buffer go back to the pool of the thread,
+ * whose cache hands them out again for the next burst. */
+static void buffer_trim(buffer_t *buf) {
+	seg_t *seg, *next;
+
+	if (buf->ring) {
+		return;
+	}
+	trim_spare(buf, 0);
+	if (buf->avail || buf->head == &buf->idle) {
+		return;
+	}
+	for (seg = buf->head; seg; seg = next) {
+		next = seg->next;
+		if (seg != &buf->idle) {
+			seg_free(seg);
 		}
-		buf->rpos += nread;
-		if (buf->rpos >= buf->wpos) {
-			buf->rpos = buf->wpos = 0;
+	}
+	buf->idle.next = 0;
+	buf->idle.rpos = buf->idle.wpos = 0;
+	buf->head = buf->tail = &buf->idle;
+}
+
+
+static void buffer_set_limits(buffer_t *buf, uint32_t low, uint32_t cap) {
+	buf->low = max(low, 64);
+	buf->cap = max(cap, buf->low);
+	buf->grow = min(max(buf->grow, buf->low), buf->cap);
+}
+
+
+static uint32_t buffer_read(buffer_t *buf, void *mem, uint32_t len) {
+	uint32_t nread = min(len, buf->avail), done = 0;
+	seg_t *seg;
+
+	if (mem) {
+		for (seg = buf->head; done < nread; seg = seg->next) {
+			uint32_t k = min(nread - done, seg->wpos - seg->rpos);
+			memcpy((uint8_t *)mem + done, seg->base + seg->rpos, k);
+			done += k;
 		}
 	}
+	consume(buf, nread);
+	if (buf->avail == 0) {
+		buffer_trim(buf);
+	}
 	return nread;
 }
 
 
 static uint32_t buffer_write(buffer_t *buf, const void *mem, uint32_t len) {
-	if (buf->wpos + len > buf->size) {
-		if (-1 == buffer_extend(buf, len)) {
+	uint32_t done = 0;
+
+	if (!mem) {
+		commit(buf, len);
+		return len;
+	}
+	while (done < len) {
+		seg_t *tail = buf->tail;
+		uint32_t k = min(len - done, tail->size - tail->wpos);
+		if (k == 0) {
+			if (link_seg(buf, 0)) {
+				break;
+			}
+			continue;
+		}
+		memcpy(tail->base + tail->wpos, (const uint8_t *)mem + done, k);
+		tail->wpos += k;
+		buf->avail += k;
+		done += k;
+	}
+	buf->peak = max(buf->peak, buf->avail);
+	trim_spare(buf, 1);
+	return done;
+}
+
+
+static int buffer_rvec(buffer_t *buf, struct iovec *iov, int iovcnt) {
+	seg_t *seg;
+	int n = 0;
+
+	for (seg = buf->head; seg && n < iovcnt && buf->avail; seg = seg == buf->tail ? 0 : seg->next) {
+		if (seg->wpos > seg->rpos) {
+			iov[n].iov_base = seg->base + seg->rpos;
+			iov[n].iov_len = seg->wpos - seg->rpos;
+			n++;
+		}
+	}
+	return n;
+}
+
+
+static int buffer_wvec(buffer_t *buf, struct iovec *iov, int iovcnt) {
+	seg_t *seg = buf->tail;
+	int n = 0;
+
+	if (buf->avail == 0) {
+		seg->rpos = seg->wpos = 0;
+	}
+	if (iovcnt > 0 && seg == &buf->idle) {
+		seg_t **pnext;
+		if (!(seg = seg_new(buf, buf->grow))) {
 			return 0;
 		}
+		for (pnext = &buf->head; *pnext != &buf->idle; pnext = &(*pnext)->next) {}
+		*pnext = seg;
+		buf->tail = seg;
 	}
-	if (mem) {
-		memmove(buf->buf + buf->rpos, mem, len);
+	if (iovcnt > 0 && seg->size > seg->wpos) {
+		iov[n].iov_base = seg->base + seg->wpos;
+		iov[n].iov_len = seg->size - seg->wpos;
+		n++;
 	}
-	buf->wpos += len;
-	return len;
+	while (n < iovcnt && !buf->ring) {
+		if (!seg->next && !(seg->next = seg_new(buf, buf->grow))) {
+			break;
+		}
+		seg = seg->next;
+		iov[n].iov_base = seg->base;
+		iov[n].iov_len = seg->size;
+		n++;
+	}
+	return n;
+}
+
+
+/* The slice goes in place of an empty tail, which stays last, or is
+ * followed by a new tail. */
+static int buffer_append(buffer_t *buf, slice_t *sl, uint32_t off, uint32_t len) {
+	seg_t *ref, *tail = buf->tail, **pnext;
+
+	if (off > sl->len || len > sl->len - off) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (len == 0) {
+		return 0;
+	}
+	if (buf->ring) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	ref = pool.get(sizeof *ref);
+	if (!ref) {
+		return -1;
+	}
+	ref->base = sl->data + off;
+	ref->size = ref->wpos = len;
+	ref->rpos = 0;
+	if (tail->wpos == tail->rpos) {
+		tail->rpos = tail->wpos = 0;
+		for (pnext = &buf->head; *pnext != tail; pnext = &(*pnext)->next) {}
+		*pnext = ref;
+		ref->next = tail;
+	} else {
+		seg_t *seg = seg_new(buf, buf->grow);
+		if (!seg) {
+			pool.put(ref);
+			return -1;
+		}
+		tail->next = ref;
+		ref->next = seg;
+		buf->tail = seg;
+	}
+	ref->slice = slice_ref(sl);
+	buf->avail += len;
+	buf->peak = max(buf->peak, buf->avail);
+	return 0;
+}
+
+
+static uint32_t buffer_capacity(buffer_t *buf) {
+	return buf->ring;
 }
 
 
 static uint32_t buffer_avail(buffer_t *buf) {
-	return buf->wpos - buf->rpos;
+	return buf->avail;
 }
 
 
 static uint8_t *buffer_rpos(buffer_t *buf) {
-	return buf->buf + buf->rpos;
+	return linearize(buf);
 }
 
 
 static uint32_t buffer_space(buffer_t *buf) {
-	return buf->size - buf->wpos;
+	return buf->tail->size - buf->tail->wpos;
 }
 
 
 static uint8_t *buffer_wpos(buffer_t *buf) {
-	return buf->buf + buf->wpos;
+	return buf->tail->base + buf->tail->wpos;
 }
 
 
-static uint8_t *buffer_yield(buffer_t *buf, const char *delim, uint32_t delim_len, uint32_t *len) {
-	uint8_t *start = buf->buf + buf->rpos;
-	uint8_t *ret;
-	uint8_t *found = memmem(start, buf->wpos - buf->rpos, delim, delim_len);
-	uint32_t off;
-	if (found) {
-		off = found + delim_len - start;
-		ret = buf->buf + buf->rpos;
-		buf->rpos += off;
-		if (buf->rpos >= buf->wpos) {
-			buf->rpos = buf->wpos = 0;
+/* Return the first i with p[i] == a and p[i + 1] == b, a at the last
+ * byte matches alone, n if there is none. */
+static uint32_t find_pair_scalar(const uint8_t *p, uint32_t n, uint8_t a, uint8_t b) {
+	const uint8_t *q;
+	uint32_t i = 0;
+
+	while (i < n && (q = memchr(p + i, a, n - i))) {
+		i = q - p;
+		if (i + 1 == n || p[i + 1] == b) {
+			return i;
+		}
+		i++;
+	}
+	return n;
+}
+
+
+#ifdef __SSE2__
+static uint32_t find_pair_sse2(const uint8_t *p, uint32_t n, uint8_t a, uint8_t b) {
+	__m128i va = _mm_set1_epi8((char)a), vb = _mm_set1_epi8((char)b);
+	uint32_t i;
+
+	for (i = 0; i + 17 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i y = _mm_loadu_si128((const __m128i *)(p + i + 1));
+		int m = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(x, va), _mm_cmpeq_epi8(y, vb)));
+		if (m) {
+			return i + __builtin_ctz(m);
+		}
+	}
+	return i + find_pair_scalar(p + i, n - i, a, b);
+}
+#endif
+
+
+#ifdef BUF_AVX2
+__attribute__((target("avx2")))
+static uint32_t find_pair_avx2(const uint8_t *p, uint32_t n, uint8_t a, uint8_t b) {
+	__m256i va = _mm256_set1_epi8((char)a), vb = _mm256_set1_epi8((char)b);
+	uint32_t i;
+
+	for (i = 0; i + 33 <= n; i += 32) {
+		__m256i x = _mm256_loadu_si256((const __m256i *)(p + i));
+		__m256i y = _mm256_loadu_si256((const __m256i *)(p + i + 1));
+		uint32_t m = _mm256_movemask_epi8(_mm256_and_si256(_mm256_cmpeq_epi8(x, va), _mm256_cmpeq_epi8(y, vb)));
+		if (m) {
+			return i + __builtin_ctz(m);
+		}
+	}
+	return i + find_pair_scalar(p + i, n - i, a, b);
+}
+#endif
+
+
+static uint32_t find_pair(const uint8_t *p, uint32_t n, uint8_t a, uint8_t b) {
+#ifdef BUF_AVX2
+	static int avx2 = -1;
+	int has = __atomic_load_n(&avx2, __ATOMIC_RELAXED);
+	if (has < 0) {
+		__builtin_cpu_init();
+		has = __builtin_cpu_supports("avx2") ? 1 : 0;
+		__atomic_store_n(&avx2, has, __ATOMIC_RELAXED);
+	}
+	if (has) {
+		return find_pair_avx2(p, n, a, b);
+	}
+#endif
+#ifdef __SSE2__
+	return find_pair_sse2(p, n, a, b);
+#else
+	return find_pair_scalar(p, n, a, b);
+#endif
+}
+
+
+/* Return the first i with p[i] in set, n if there is none. */
+static uint32_t find_set(const uint8_t *p, uint32_t n, const uint8_t *set, int nset) {
+	uint32_t i = 0;
+	int k;
+#ifdef __SSE2__
+	__m128i v[BUF_DELIMS];
+
+	for (k = 0; k < nset; k++) {
+		v[k] = _mm_set1_epi8((char)set[k]);
+	}
+	for (; i + 16 <= n; i += 16) {
+		__m128i x = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i m = _mm_cmpeq_epi8(x, v[0]);
+		int mask;
+		for (k = 1; k < nset; k++) {
+			m = _mm_or_si128(m, _mm_cmpeq_epi8(x, v[k]));
+		}
+		mask = _mm_movemask_epi8(m);
+		if (mask) {
+			return i + __builtin_ctz(mask);
 		}
-		if (len) {
-			*len = off;
+	}
+#endif
+	for (; i < n; i++) {
+		for (k = 0; k < nset; k++) {
+			if (p[i] == set[k]) {
+				return i;
+			}
 		}
-		return ret;
 	}
+	return n;
+}
+
+
+/* The key is each length followed by the bytes, all zero when it doesn't
+ * fit, then yield doesn't resume. */
+static int delims_init(delims_t *ds, const char *const *delims, const uint32_t *lens, int n) {
+	uint32_t k = 0;
+	int i, j;
+
+	if (n <= 0 || n > BUF_DELIMS) {
+		return -1;
+	}
+	memset(ds->key, 0, BUF_KEY);
+	ds->maxlen = 0;
+	ds->nfirst = 0;
+	for (i = 0; i < n; i++) {
+		if (lens[i] == 0) {
+			return -1;
+		}
+		ds->d[i] = (const uint8_t *)delims[i];
+		ds->len[i] = lens[i];
+		ds->maxlen = max(ds->maxlen, lens[i]);
+		for (j = 0; j < ds->nfirst && ds->first[j] != ds->d[i][0]; j++) {}
+		if (j == ds->nfirst) {
+			ds->first[ds->nfirst++] = ds->d[i][0];
+		}
+		if (k + 1 + lens[i] <= BUF_KEY) {
+			ds->key[k] = lens[i];
+			memcpy(ds->key + k + 1, delims[i], lens[i]);
+		}
+		k += 1 + lens[i];
+	}
+	if (k > BUF_KEY) {
+		memset(ds->key, 0, BUF_KEY);
+	}
+	ds->n = n;
 	return 0;
 }
 
 
+static int match_at(buffer_t *buf, seg_t *seg, uint32_t pos, const uint8_t *d, uint32_t len) {
+	uint32_t k;
+
+	while (len) {
+		if (pos == seg->wpos) {
+			if (seg == buf->tail) {
+				return 0;
+			}
+			seg = seg->next;
+			pos = seg->rpos;
+			continue;
+		}
+		k = min(len, seg->wpos - pos);
+		if (memcmp(seg->base + pos, d, k)) {
+			return 0;
+		}
+		d += k;
+		len -= k;
+		pos += k;
+	}
+	return 1;
+}
+
+
+/* Walk the segments from where the last search of the same delimiters
+ * stopped, a delimiter may cross segments. Return the offset of the
+ * first match from the read position, or avail if there is none. */
+static uint32_t search(buffer_t *buf, const delims_t *ds, int *which) {
+	uint32_t off = 0, i, n;
+	seg_t *seg;
+	int k;
+
+	if (!ds->key[0] || memcmp(buf->key, ds->key, BUF_KEY)) {
+		memcpy(buf->key, ds->key, BUF_KEY);
+		buf->scan = 0;
+	}
+	for (seg = buf->head; off < buf->avail; seg = seg->next) {
+		const uint8_t *p = seg->base + seg->rpos;
+		n = seg->wpos - seg->rpos;
+		for (i = buf->scan > off ? buf->scan - off : 0; i < n; i++) {
+			if (ds->n == 1 && ds->len[0] > 1) {
+				i += find_pair(p + i, n - i, ds->d[0][0], ds->d[0][1]);
+			} else if (ds->n == 1) {
+				const uint8_t *q = memchr(p + i, ds->d[0][0], n - i);
+				i = q ? (uint32_t)(q - p) : n;
+			} else {
+				i += find_set(p + i, n - i, ds->first, ds->nfirst);
+			}
+			if (i >= n) {
+				break;
+			}
+			for (k = 0; k < ds->n; k++) {
+				if (p[i] == ds->d[k][0] && match_at(buf, seg, seg->rpos + i, ds->d[k], ds->len[k])) {
+					*which = k;
+					return off + i;
+				}
+			}
+		}
+		off += n;
+	}
+	buf->scan = buf->avail > ds->maxlen - 1 ? buf->avail - (ds->maxlen - 1) : 0;
+	return buf->avail;
+}
+
+
+/* A record inside the head segment is returned in place, one spanning
+ * segments is gathered once it is complete. */
+static uint8_t *yield_delims(buffer_t *buf, const delims_t *ds, uint32_t *len, int *which) {
+	uint8_t *start;
+	uint32_t off;
+	int k = 0;
+
+	off = search(buf, ds, &k);
+	if (off == buf->avail) {
+		return 0;
+	}
+	off += ds->len[k];
+	start = buf->head->wpos - buf->head->rpos >= off ? buf->head->base + buf->head->rpos : linearize(buf);
+	if (!start) {
+		return 0;
+	}
+	consume(buf, off);
+	if (len) {
+		*len = off;
+	}
+	if (which) {
+		*which = k;
+	}
+	return start;
+}
+
+
+/* Most records end in the head segment, with the delimiter of the last
+ * call they are found there before the general search is set up. */
+static uint8_t *buffer_yield(buffer_t *buf, const char *delim, uint32_t delim_len, uint32_t *len) {
+	seg_t *head = buf->head;
+	uint8_t *p = head->base + head->rpos;
+	uint32_t n = head->wpos - head->rpos, i;
+	delims_t ds;
+
+	if (delim_len > 1 && delim_len < BUF_KEY && buf->key[0] == delim_len && !memcmp(buf->key + 1, delim, delim_len)) {
+		i = min(buf->scan, n);
+		i += find_pair(p + i, n - i, delim[0], delim[1]);
+		if (i + delim_len <= n && !memcmp(p + i, delim, delim_len)) {
+			consume(buf, i + delim_len);
+			if (len) {
+				*len = i + delim_len;
+			}
+			return p;
+		}
+		/* no delimiter fits in the head, which holds every readable byte. */
+		if (i + delim_len > n && n == buf->avail) {
+			buf->scan = n > delim_len - 1 ? n - (delim_len - 1) : 0;
+			return 0;
+		}
+	}
+
+	if (delims_init(&ds, &delim, &delim_len, 1)) {
+		return 0;
+	}
+	return yield_delims(buf, &ds, len, 0);
+}
+
+
+static uint8_t *buffer_yield_any(buffer_t *buf, const char *const *delims, int n, uint32_t *len, int *which) {
+	uint32_t lens[BUF_DELIMS];
+	delims_t ds;
+	int i;
+
+	for (i = 0; i < n && i < BUF_DELIMS; i++) {
+		lens[i] = strlen(delims[i]);
+	}
+	if (delims_init(&ds, delims, lens, n)) {
+		return 0;
+	}
+	return yield_delims(buf, &ds, len, which);
+}
+
+
 static uint32_t buffer_len(buffer_t *buf) {
-	return buf->size;
+	seg_t *seg;
+	uint32_t size = buf->ring;
+	for (seg = buf->ring ? 0 : buf->head; seg; seg = seg == buf->tail ? 0 : seg->next) {
+		if (!seg->slice) {
+			size += seg->size;
+		}
+	}
+	return size;
 }
 
 
-static uint32_t buffer_vprintf(buffer_t *buf, const char *fmt, va_list ap) {
+/* vsnprintf straight to wpos, formats again when the space was short. */
+static uint32_t slow_vprintf(buffer_t *buf, const char *format, va_list ap) {
 	va_list cpy;
-	uint32_t avail, ret;
+	uint32_t space;
+	int ret;
 
 	for (;;) {
-		char *p = (char *)buf->buf + buf->wpos;
-		avail = buf->size - buf->wpos;
+		space = buffer_space(buf);
 		va_copy(cpy, ap);
-		ret = vsnprintf(p, avail, fmt, ap);
-		va_end(ap);
+		ret = vsnprintf((char *)buffer_wpos(buf), space, format, cpy);
+		va_end(cpy);
 		if (ret <= 0) {
 			return 0;
 		}
-		if (ret <= avail) {
+		if ((uint32_t)ret < space) {
 			break;
 		}
-		buffer_extend(buf, ret);
+		if (buffer_extend(buf, ret + 1)) {
+			return 0;
+		}
 	}
-	buf->wpos += ret;
+	commit(buf, ret);
 
 	return ret;
 }
 
 
-static uint32_t buffer_printf(buffer_t *buf, const char *fmt, ...) {
+/* The bound of the output is reserved first, so the plan formats once in
+ * place. A plan that falls back, or a bound that does not fit a ring,
+ * goes to vsnprintf, which sizes exactly. */
+static uint32_t buffer_vformat(buffer_t *buf, const fmt_t *f, va_list ap) {
+	va_list cpy;
+	size_t bound;
+	uint32_t ret;
+
+	if (f->n >= 0) {
+		va_copy(cpy, ap);
+		bound = fmt.bound(f, cpy);
+		va_end(cpy);
+		if (bound <= (1U << BUF_CAP_P) && !buffer_extend(buf, bound)) {
+			ret = fmt.vformat((char *)buffer_wpos(buf), f, ap);
+			commit(buf, ret);
+			return ret;
+		}
+	}
+	return slow_vprintf(buf, f->str, ap);
+}
+
+
+static uint32_t buffer_format(buffer_t *buf, const fmt_t *f, ...) {
 	uint32_t ret;
 	va_list ap;
 
-	va_start(ap, fmt);
-	ret = buffer_vprintf(buf, fmt, ap);
+	va_start(ap, f);
+	ret = buffer_vformat(buf, f, ap);
+	va_end(ap);
+
+	return ret;
+}
+
+
+static uint32_t buffer_vprintf(buffer_t *buf, const char *format, va_list ap) {
+	fmt_t f;
+
+	fmt.parse(&f, format);
+	return buffer_vformat(buf, &f, ap);
+}
+
+
+static uint32_t buffer_printf(buffer_t *buf, const char *format, ...) {
+	uint32_t ret;
+	va_list ap;
+
+	va_start(ap, format);
+	ret = buffer_vprintf(buf, format, ap);
 	va_end(ap);
 
 	return ret;
@@ -170,6 +986,7 @@ static uint32_t buffer_printf(buffer_t *buf, const char *fmt, ...) {
 
 struct buffer_ buffer = {
 	buffer_new,
+	buffer_new_ring,
 	buffer_free,
 	buffer_read,
 	buffer_write,
@@ -178,8 +995,64 @@ struct buffer_ buffer = {
 	buffer_space,
 	buffer_wpos,
 	buffer_yield,
+	buffer_yield_any,
 	buffer_len,
+	buffer_capacity,
 	buffer_extend,
+	buffer_rehome,
+	buffer_rvec,
+	buffer_wvec,
+	buffer_append,
+	buffer_trim,
+	buffer_set_limits,
 	buffer_vprintf,
-	buffer_printf
+	buffer_printf,
+	buffer_vformat,
+	buffer_format
+};
+
+
+static slice_t *slice_new(const void *mem, uint32_t len) {
+	slice_t *sl = pool.get(sizeof *sl + len);
+	if (!sl) {
+		return 0;
+	}
+	sl->ref = 1;
+	sl->len = len;
+	if (mem) {
+		memcpy(sl->data, mem, len);
+	}
+	return sl;
+}
+
+
+static slice_t *slice_ref(slice_t *sl) {
+	__atomic_add_fetch(&sl->ref, 1, __ATOMIC_RELAXED);
+	return sl;
+}
+
+
+static void slice_unref(slice_t *sl) {
+	if (__atomic_sub_fetch(&sl->ref, 1, __ATOMIC_ACQ_REL) == 0) {
+		pool.put(sl);
+	}
+}
+
+
+static uint8_t *slice_data(slice_t *sl) {
+	return sl->data;
+}
+
+
+static uint32_t slice_len(slice_t *sl) {
+	return sl->len;
+}
+
+
+struct slice_ slice = {
+	slice_new,
+	slice_ref,
+	slice_unref,
+	slice_data,
+	slice_len
 };
@@ -2,12 +2,28 @@
  * #Buffer
  *
  * The buffer APIs provids a readable, writable and
- * scalable buffer memory with fix-size.
+ * scalable buffer memory as a chain of fix-size segments.
  *
  *  already yield    read able       write able
  * |___________|__________________|____________|
  * start   read pos			write pos	    size
  *
+ * Appends fill the last segment and link new ones, twice as large as the
+ * one before up to a cap, existing bytes are never copied to grow. Reads
+ * release whole segments, which are reused by the next write. rpos and
+ * yield gather the readable bytes into one segment only when a caller
+ * needs them contiguous. A new or drained buffer holds no segment, the
+ * first write takes one from the pool.
+ *
+ * A ring buffer is one fixed region mapped twice back to back, the
+ * readable and the writable part are always contiguous, so rpos and yield
+ * never copy and rvec and wvec return one region. Writes past the
+ * capacity are short.
+ *
+ * A slice is an immutable refcounted block. append links a range of it
+ * into the chain without copying, so one frame queued on many buffers
+ * is kept once and released by the last reader.
+ *
  */
 
 #ifndef BUFFER_H
@@ -15,23 +31,35 @@
 
 #include <stdint.h>
 #include <stdarg.h>
+#include <sys/uio.h>
+
+#include "fmt.h"
 
 #ifdef __cplusplus
 extern "C"{
 #endif
 
 #define BUF_SIZE_P	13
+#define BUF_LOW_P	10
+#define BUF_CAP_P	20
+#define BUF_DELIMS	8
 
 struct _buf;
 typedef struct _buffer buffer_t;
+typedef struct _slice slice_t;
 
 extern struct buffer_ {
-	/** Create a buffer with length specify of size 
-	 *  if size is 0, default size 1 << BUF_SIZE_P
-	 *  is selected.
+	/** Create a buffer with segments of size bytes, segment header
+	 *  included, if size is 0, default size 1 << BUF_SIZE_P
+	 *  is selected. Memory comes from the pool of the thread that
+	 *  writes first.
 	 */
 	buffer_t *(*new)(uint32_t size);
 
+	/** Create a ring buffer of size bytes, rounded up to pages. Return 0
+	 *  with ENOTSUP where memfd_create is not available. */
+	buffer_t *(*new_ring)(uint32_t size);
+
 	/** Free the buffer and it's memory. */
 	void (*free)(buffer_t *buf);
 
@@ -44,36 +72,136 @@ extern struct buffer_ {
 	/** Return the readable memory of the buffer. */
 	uint32_t (*avail)(buffer_t *buf);
 
-	/** Return the read position of the buffer. */
+	/** Return the read position of the buffer, the readable memory is
+	 *  made contiguous first. */
 	uint8_t *(*rpos)(buffer_t *buf);
 
-	/** Return the space can write if not extend. */
+	/** Return the contiguous space can write if not extend. */
 	uint32_t (*space)(buffer_t *buf);
 
-	/** Return the write position of the buffer. */
+	/** Return the write position of the buffer, write(buf, 0, n) commits
+	 *  n bytes written there. */
 	uint8_t *(*wpos)(buffer_t *buf);
 
-	/** Yield when find a record. */
+	/**
+	 * Yield when find a record, ended by delim.
+	 *
+	 * The search resumes where the last one for the same delimiter
+	 * stopped, so a long record arriving in pieces is scanned once. The
+	 * record is returned in place when it fits the head segment, else it
+	 * is gathered into one segment once complete.
+	 */
 	uint8_t *(*yield)(buffer_t *buf, const char *delim, uint32_t delim_len, uint32_t *len);
 
+	/** Yield a record ended by the first match of any of n (up to
+	 *  BUF_DELIMS) delimiter strings, *which is set to the one found.
+	 *  At one position the first listed that matches wins. */
+	uint8_t *(*yield_any)(buffer_t *buf, const char *const *delims, int n, uint32_t *len, int *which);
+
 	/** Return the total length of the buffer. */
 	uint32_t (*len)(buffer_t *buf);
 
-	/** Extern the buffer space. */
+	/** Return the capacity of a ring buffer, 0 for a growing one. */
+	uint32_t (*capacity)(buffer_t *buf);
+
+	/** Extern the buffer space, so space() is at least len. */
 	int (*extend)(buffer_t *buf, uint32_t len);
 
-	/** Vprintf a format string to the buffer. */
-	uint32_t (*vprintf)(buffer_t *buf, const char *fmt, va_list ap);
+	/** Move the memory of the buffer to a fresh allocation of the calling
+	 *  thread, so a pinned thread gets pages of it's own NUMA node. */
+	int (*rehome)(buffer_t *buf);
+
+	/** Fill iov with up to iovcnt readable segments, for writev. */
+	int (*rvec)(buffer_t *buf, struct iovec *iov, int iovcnt);
+
+	/**
+	 * Fill iov with iovcnt writable regions, for readv.
+	 *
+	 * The first one is the space left in the last segment, the others are
+	 * new segments reserved until write(buf, 0, n) commits the n bytes read
+	 * into them. Return how many regions could be reserved.
+	 */
+	int (*wvec)(buffer_t *buf, struct iovec *iov, int iovcnt);
+
+	/**
+	 * Append len bytes of a slice at off without copying them.
+	 *
+	 * The buffer holds a reference until the next write after the bytes
+	 * are read, rvec returns them in place and yield or rpos copy them out
+	 * only when a record spans segments. Return -1 with EINVAL if the
+	 * range is not inside the slice, ENOTSUP on a ring buffer, ENOMEM if
+	 * no segment could be linked.
+	 */
+	int (*append)(buffer_t *buf, slice_t *sl, uint32_t off, uint32_t len);
+
+	/**
+	 * Release the spare segments, and every segment of an empty buffer.
+	 *
+	 * An empty buffer costs only it's header, the next write gets a
+	 * segment sized after the average burst the buffer held, rounded up
+	 * to a power of two times the low watermark. Done by read when it
+	 * empties the buffer. Memory returned by yield or rpos is invalid
+	 * after.
+	 */
+	void (*trim)(buffer_t *buf);
+
+	/**
+	 * Set the segment size limits, 1 << BUF_LOW_P and 1 << BUF_CAP_P by
+	 * default. New segments of a burst double from the learned size up to
+	 * cap, an empty buffer shrinks down to low at most.
+	 */
+	void (*set_limits)(buffer_t *buf, uint32_t low, uint32_t cap);
+
+	/**
+	 * Vprintf a format string to the buffer.
+	 *
+	 * The format is parsed on every call, formatted by fmt without
+	 * vsnprintf when it can, see vformat.
+	 */
+	uint32_t (*vprintf)(buffer_t *buf, const char *format, va_list ap);
 
 	/** Printf a format string to the buffer. */
-	uint32_t (*printf)(buffer_t *buf, const char *fmt, ...)
+	uint32_t (*printf)(buffer_t *buf, const char *format, ...)
 #ifdef __GNUC__
 		__attribute__((format(printf, 2, 3)))
 #endif
 		;
 
+	/**
+	 * Vprintf with a format parsed once by fmt.new or fmt.parse.
+	 *
+	 * An upper bound of the output is reserved in the tail segment and
+	 * the output is written there once, so a short tail takes a new
+	 * segment even when the exact output would have fit. Plans that fall
+	 * back, bounds past 1 << BUF_CAP_P and bounds that do not fit a ring
+	 * are formatted with vsnprintf. Return the bytes written, 0 on error.
+	 */
+	uint32_t (*vformat)(buffer_t *buf, const fmt_t *f, va_list ap);
+
+	/** Printf with a format parsed once, the arguments are not checked
+	 *  against it by the compiler. */
+	uint32_t (*format)(buffer_t *buf, const fmt_t *f, ...);
+
 } buffer;
 
+extern struct slice_ {
+	/** Create a slice of len bytes with one reference, copied from mem
+	 *  unless it is 0, then fill slice.data before sharing it. */
+	slice_t *(*new)(const void *mem, uint32_t len);
+
+	/** Take a reference, from any thread. */
+	slice_t *(*ref)(slice_t *sl);
+
+	/** Drop a reference, the last one frees the slice. From any thread. */
+	void (*unref)(slice_t *sl);
+
+	/** Return the bytes of the slice. */
+	uint8_t *(*data)(slice_t *sl);
+
+	/** Return the length of the slice. */
+	uint32_t (*len)(slice_t *sl);
+} slice;
+
 #ifdef __cplusplus
 }
 #endif
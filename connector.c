@@ -10,6 +10,8 @@ struct _connector {
 	eventloop_t *loop;
 	sockaddr_t addr;
 	connector_pt cb;
+	uint32_t timeout;
+	timeout_t to;
 	char name[64];
 };
 
@@ -21,12 +23,14 @@ static connector_t *connector_new(const char *name, eventloop_t *loop, connector
 	}
 	conct->loop = loop;
 	conct->cb = cb;
+	timewheel.init(&conct->to, 0, conct);
 	snprintf(conct->name, sizeof conct->name, "%s", name);
 	return conct;
 }
 
 
 static void connector_free(connector_t *conct) {
+	eventloop.cancel(conct->loop, &conct->to);
 	alloc(conct, 0);
 }
 
@@ -42,13 +46,14 @@ static void _connector_dispatch(eventloop_t *loop, event_t *ev) {
 	int err = 0;
 	socket_t *sock = 0;
 
-	if (ev->mask == EVMASK_TIME) {
+	eventloop.cancel(conct->loop, &conct->to);
+	if (ev->fired == EVMASK_TIME) {
 		err = ETIMEDOUT;
 	} else {
 		socklen_t slen = sizeof err;
 		if (getsockopt(ev->fd, SOL_SOCKET, SO_ERROR, (void *)&err, &slen) < 0) {
 			err = errno;
-		} else {
+		} else if (err == 0) {
 			sockaddr_t addr;
 			err = sockaddr.sockname(ev->fd, &addr);
 			if (err == 0) {
@@ -56,13 +61,25 @@ static void _connector_dispatch(eventloop_t *loop, event_t *ev) {
 			}
 		}
 	}
+	if (!sock) {
+		ev->mask = EVMASK_NONE;
+		eventloop.apply(conct->loop, ev);
+		close(ev->fd);
+	}
 	conct->cb(conct, err, sock);
 }
 
 
+static void _connector_timeout(timeout_t *to) {
+	connector_t *conct = to->ud;
+	conct->ev.fired = EVMASK_TIME;
+	_connector_dispatch(conct->loop, &conct->ev);
+}
+
+
 static void connector_connect(connector_t *conct) {
 	int ret;
-	socket_t *sock;
+	socket_t *sock = 0;
 	sockaddr_t addr;
 	int err = 0;
 
@@ -75,6 +92,10 @@ static void connector_connect(connector_t *conct) {
 	if (ret < 0 && errno == EINPROGRESS) {
 		event.init(&conct->ev, fd, EVMASK_WRITE, _connector_dispatch, 0);
 		eventloop.apply(conct->loop, &conct->ev);
+		if (conct->timeout) {
+			timewheel.init(&conct->to, _connector_timeout, conct);
+			eventloop.timeout(conct->loop, &conct->to, conct->timeout);
+		}
 		return;
 	}
 	err = sockaddr.sockname(fd, &addr);
@@ -85,6 +106,11 @@ static void connector_connect(connector_t *conct) {
 }
 
 
+static void connector_set_timeout(connector_t *conct, uint32_t ms) {
+	conct->timeout = ms;
+}
+
+
 static eventloop_t *connector_loop(connector_t *conct) {
 	return conct->loop;
 }
@@ -94,5 +120,6 @@ struct connector_ connector = {
 	connector_free,
 	connector_bind,
 	connector_connect,
+	connector_set_timeout,
 	connector_loop
 };
@@ -16,6 +16,7 @@ extern struct connector_ {
 	void (*free)(connector_t *conct);
 	void (*bind)(connector_t *conct, const sockaddr_t *addr);
 	void (*connect)(connector_t *conct);
+	void (*set_timeout)(connector_t *conct, uint32_t ms);
 	eventloop_t *(*loop)(connector_t *conct);
 } connector;
 
@@ -13,6 +13,7 @@
 #endif
 
 #define MAX_POLL_EVENT	256
+#define SHARED_POLL_EVENT	1
 #define DEFAULT_POLL_MASK	EPOLLHUP | EPOLLERR | EPOLLET
 
 struct _eventpoll {
@@ -20,6 +21,8 @@ struct _eventpoll {
 	event_t wakev;
 	dispatch_pt disp;
 	void *ud;
+	event_t **changes;
+	int nchanges, cchanges;
 };
 
 static void wake_cb(struct _eventloop *loop, event_t *ev) {
@@ -61,6 +64,7 @@ static eventpoll_t *eventpoll_new(dispatch_pt f, void *ud) {
 	poll->ud = ud;
 
 	event.init(&poll->wakev, wakeupfd, EVMASK_READ, wake_cb, 0);
+	poll->wakev.label = "wakeup";
 
 	evt.events = EPOLLIN | DEFAULT_POLL_MASK;
 	evt.data.ptr = &poll->wakev;
@@ -85,14 +89,13 @@ err:
 static void eventpoll_free(eventpoll_t *poll) {
 	close(poll->pollfd);
 	close(poll->wakev.fd);
+	alloc(poll->changes, 0);
 	alloc(poll, 0);
 }
 
 
-static int eventpoll_apply(eventpoll_t *poll, event_t *ev) {
-	struct epoll_event evt;
-	int ret, newmask;
-
+static int poll_mask(event_t *ev) {
+	int newmask;
 	switch (ev->mask & (EVMASK_READ | EVMASK_WRITE)) {
 		case EVMASK_READ | EVMASK_WRITE:
 			newmask = EPOLLIN | EPOLLOUT | DEFAULT_POLL_MASK;
@@ -108,6 +111,14 @@ static int eventpoll_apply(eventpoll_t *poll, event_t *ev) {
 			newmask = 0;
 			break;
 	}
+	return newmask;
+}
+
+
+static int commit(eventpoll_t *poll, event_t *ev) {
+	struct epoll_event evt;
+	int ret, newmask = poll_mask(ev);
+
 	if (newmask == ev->last_mask) {
 		return 0;
 	}
@@ -116,6 +127,7 @@ static int eventpoll_apply(eventpoll_t *poll, event_t *ev) {
 		if (ret < 0 && errno == ENOENT) {
 			ret = 0;
 		}
+		ev->last_mask = 0;
 	} else {
 		int op = ev->last_mask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
 		evt.events = newmask;
@@ -130,6 +142,56 @@ static int eventpoll_apply(eventpoll_t *poll, event_t *ev) {
 }
 
 
+static void unchange(eventpoll_t *poll, event_t *ev) {
+	event_t *last = poll->changes[--poll->nchanges];
+	poll->changes[ev->change - 1] = last;
+	last->change = ev->change;
+	ev->change = 0;
+}
+
+
+/* Interest changes are recorded and committed once before the next wait,
+ * so any sequence of changes to an event costs at most one epoll_ctl.
+ * Removal is immediate, the fd may be closed and the event freed
+ * right after. */
+static int eventpoll_apply(eventpoll_t *poll, event_t *ev) {
+	if (poll_mask(ev) == 0) {
+		if (ev->change) {
+			unchange(poll, ev);
+		}
+		return commit(poll, ev);
+	}
+	if (ev->change) {
+		return 0;
+	}
+	if (poll->nchanges == poll->cchanges) {
+		int n = poll->cchanges ? poll->cchanges * 2 : 64;
+		event_t **changes = alloc(poll->changes, n * sizeof *changes);
+		if (!changes) {
+			return commit(poll, ev);
+		}
+		poll->changes = changes;
+		poll->cchanges = n;
+	}
+	poll->changes[poll->nchanges++] = ev;
+	ev->change = poll->nchanges;
+	return 0;
+}
+
+
+static void commit_changes(eventpoll_t *poll) {
+	int i;
+	for (i = 0; i < poll->nchanges; i++) {
+		event_t *ev = poll->changes[i];
+		ev->change = 0;
+		if (commit(poll, ev)) {
+			logger.warn("epoll_ctl fd %d error: %s\n", ev->fd, strerror(errno));
+		}
+	}
+	poll->nchanges = 0;
+}
+
+
 static void eventpoll_wakeup(eventpoll_t *poll) {
 	uint64_t on = 1;
 	ssize_t n = write(poll->wakev.fd, &on, sizeof on);
@@ -139,12 +201,13 @@ static void eventpoll_wakeup(eventpoll_t *poll) {
 }
 
 
-static int eventpoll_poll(eventpoll_t *poll) {
+static int eventpoll_poll(eventpoll_t *poll, int timeout) {
 	struct epoll_event evt[MAX_POLL_EVENT];
 	event_t *ev;
 	int i, n, mask;
 
-	n = epoll_wait(poll->pollfd, evt, MAX_POLL_EVENT, -1);
+	commit_changes(poll);
+	n = epoll_wait(poll->pollfd, evt, MAX_POLL_EVENT, timeout);
 	for (i = 0; i < n; i++) {
 		ev = evt[i].data.ptr;
 		switch (evt[i].events & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP)) {
@@ -160,8 +223,86 @@ static int eventpoll_poll(eventpoll_t *poll) {
 			default:
 				mask = EVMASK_ERROR;
 		}
-		ev->last_mask = DEFAULT_POLL_MASK;
-		ev->mask = mask;
+		ev->fired = mask;
+		poll->disp(poll, ev, poll->ud);
+	}
+	return n;
+}
+
+
+/* The wakeup of a shared poll is level triggered and never consumed, it
+ * only serves to get every poller out on exit. */
+static void shared_wake_cb(struct _eventloop *loop, event_t *ev) {
+	(void)loop;
+	(void)ev;
+}
+
+
+static eventpoll_t *shared_new(dispatch_pt f, void *ud) {
+	struct epoll_event evt;
+	eventpoll_t *poll = eventpoll_new(f, ud);
+	if (!poll) {
+		return 0;
+	}
+	poll->wakev.cb = shared_wake_cb;
+	evt.events = EPOLLIN;
+	evt.data.ptr = &poll->wakev;
+	if (epoll_ctl(poll->pollfd, EPOLL_CTL_MOD, poll->wakev.fd, &evt)) {
+		eventpoll_free(poll);
+		return 0;
+	}
+	return poll;
+}
+
+
+/* Every apply of a live event re-arms it. */
+static int shared_apply(eventpoll_t *poll, event_t *ev) {
+	struct epoll_event evt;
+	int ret, newmask = poll_mask(ev) & ~EPOLLET;
+
+	if (newmask == 0) {
+		ret = 0;
+		if (ev->last_mask) {
+			ret = epoll_ctl(poll->pollfd, EPOLL_CTL_DEL, ev->fd, &evt);
+			if (ret < 0 && errno == ENOENT) {
+				ret = 0;
+			}
+		}
+		ev->last_mask = 0;
+		return ret;
+	}
+	newmask |= EPOLLONESHOT;
+	evt.events = newmask;
+	evt.data.ptr = ev;
+	ret = epoll_ctl(poll->pollfd, ev->last_mask ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, ev->fd, &evt);
+	ev->last_mask = ret ? 0 : newmask;
+	return ret;
+}
+
+
+/* One event per wait, nothing queues behind a slow handler while other
+ * threads are idle. */
+static int shared_poll(eventpoll_t *poll, int timeout) {
+	struct epoll_event evt[SHARED_POLL_EVENT];
+	event_t *ev;
+	int i, n;
+
+	n = epoll_wait(poll->pollfd, evt, SHARED_POLL_EVENT, timeout);
+	for (i = 0; i < n; i++) {
+		ev = evt[i].data.ptr;
+		switch (evt[i].events & (EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP)) {
+			case EPOLLIN:
+				ev->fired = EVMASK_READ;
+				break;
+			case EPOLLOUT:
+				ev->fired = EVMASK_WRITE;
+				break;
+			case EPOLLIN | EPOLLOUT:
+				ev->fired = EVMASK_READ | EVMASK_WRITE;
+				break;
+			default:
+				ev->fired = EVMASK_ERROR;
+		}
 		poll->disp(poll, ev, poll->ud);
 	}
 	return n;
@@ -173,7 +314,24 @@ struct eventpoll_ eventpoll = {
 	eventpoll_free,
 	eventpoll_apply,
 	eventpoll_wakeup,
-	eventpoll_poll
+	eventpoll_poll,
+	0,
+	0,
+	0,
+	0
+};
+
+
+struct eventpoll_ eventpoll_shared = {
+	shared_new,
+	eventpoll_free,
+	shared_apply,
+	eventpoll_wakeup,
+	shared_poll,
+	0,
+	0,
+	0,
+	0
 };
 
 #endif // HAVE_SYS_EPOLL_H
@@ -13,10 +13,18 @@ static void event_free(event_t *ev) {
 static void event_init(event_t *ev, int fd, int mask, event_pt cb, void *ud) {
 	ev->fd = fd;
 	ev->mask = mask;
+	ev->fired = 0;
 	ev->cb = cb;
 	ev->ud = ud;
+	ev->label = 0;
+	ev->prio = EVPRIO_NORMAL;
 	ev->last_mask = 0;
-	ev->next = 0;
+	ev->change = 0;
+	ev->queued = 0;
+	ev->node.next = 0;
+	ev->rmask = 0;
+	ev->rnext = 0;
+	ev->rprev = 0;
 }
 
 struct event_ event = {
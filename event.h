@@ -1,6 +1,8 @@
 #ifndef EVENT_H
 #define EVENT_H
 
+#include "mpsc.h"
+
 #ifdef __cplusplus
 extern "C"{
 #endif
@@ -10,6 +12,12 @@ extern "C"{
 #define EVMASK_WRITE	0x02
 #define EVMASK_ERROR	0x04
 #define EVMASK_TIME		0x08
+#define EVMASK_FLUSH	0x10
+
+#define EVPRIO_HIGH		0
+#define EVPRIO_NORMAL	1
+#define EVPRIO_LOW		2
+#define EVPRIO_CLASSES	3
 
 struct _eventloop;
 typedef struct _event event_t;
@@ -17,11 +25,18 @@ typedef void (*event_pt)(struct _eventloop *loop, event_t *ev);
 
 struct _event {
 	int fd;
-	int mask;
+	int mask;	/* interest, applied with eventloop.apply. */
+	int fired;	/* events reported to cb. */
 	event_pt cb;
 	void *ud;
+	const char *label;	/* groups dispatch stats, by cb when 0. */
+	int prio;			/* dispatch class, EVPRIO_NORMAL by default. */
 	int last_mask;
-	struct _event *next;
+	int change;	/* backend change list slot + 1, 0 if none. */
+	int queued;
+	mpscnode_t node;
+	int rmask;	/* mask to dispatch from the ready list. */
+	event_t *rnext, **rprev;
 };
 
 extern struct event_ {
@@ -2,103 +2,553 @@
 #include "eventloop.h"
 #include "lock.h"
 #include "log.h"
+#include "timer.h"
+
+struct _taskcell {
+	unsigned seq;
+	task_t task;
+};
+
+#define STAT_INC(x, n)	__atomic_store_n(&(x), (x) + (n), __ATOMIC_RELAXED)
+
+static histogram_t *stat_label(eventloop_stats_t *st, event_t *ev) {
+	uintptr_t key = ev->label ? (uintptr_t)ev->label : (uintptr_t)ev->cb;
+	int i;
+	for (i = 0; i < EVENTLOOP_STAT_LABELS; i++) {
+		if (st->labels[i].key == key) {
+			return &st->labels[i].dispatch;
+		}
+		if (st->labels[i].key == 0) {
+			st->labels[i].label = ev->label;
+			__atomic_store_n(&st->labels[i].key, key, __ATOMIC_RELEASE);
+			return &st->labels[i].dispatch;
+		}
+	}
+	return &st->other;
+}
+
+
+static void dispatch(eventloop_t *loop, event_t *ev) {
+	eventloop_stats_t *st = loop->stats;
+	histogram_t *h;
+	int64_t start;
+
+	if (!st) {
+		ev->cb(loop, ev);
+		return;
+	}
+	h = stat_label(st, ev);
+	start = timer.usec();
+	if (!loop->polled) {
+		loop->polled = start;
+	}
+	ev->cb(loop, ev);
+	histogram.record(h, timer.usec() - start);
+	STAT_INC(st->dispatches, 1);
+}
+
+
+static void eventloop_ready(eventloop_t *loop, event_t *ev, int mask);
 
 static void _dispatch(eventpoll_t *poll, event_t *ev, void *ud) {
 	(void)poll;
 	eventloop_t *loop = ud;
-	ev->cb(loop, ev);
+	if (loop->classes) {
+		eventloop_ready(loop, ev, ev->fired);
+		return;
+	}
+	dispatch(loop, ev);
 }
 
-static void eventloop_init(eventloop_t *loop) {
+static int eventloop_init_tasks(eventloop_t *loop) {
+	unsigned i, n = 1 << EVENTLOOP_TASKS_P;
+	loop->tasks = alloc(0, n * sizeof *loop->tasks);
+	if (!loop->tasks) {
+		return -1;
+	}
+	for (i = 0; i < n; i++) {
+		loop->tasks[i].seq = i;
+	}
+	loop->task_mask = n - 1;
+	loop->task_budget = EVENTLOOP_TASK_BUDGET;
+	loop->read_budget = EVENTLOOP_READ_BUDGET;
+	loop->accept_budget = EVENTLOOP_ACCEPT_BUDGET;
+	for (i = 0; i < EVPRIO_CLASSES; i++) {
+		loop->ready_tail[i] = &loop->ready[i];
+		loop->weight[i] = 1 << (EVPRIO_CLASSES - 1 - i);
+	}
+	return 0;
+}
+
+
+static int eventloop_init_backend(eventloop_t *loop, const struct eventpoll_ *backend) {
 	memset(loop, 0, sizeof *loop);
-	loop->poll = eventpoll.new(_dispatch, loop);
+	loop->backend = backend;
+	loop->poll = backend->new(_dispatch, loop);
+	if (!loop->poll) {
+		return -1;
+	}
+	loop->wheel = timewheel.new(timer.now());
+	mpsc.init(&loop->pandings);
+	if (eventloop_init_tasks(loop)) {
+		timewheel.free(loop->wheel);
+		backend->free(loop->poll);
+		return -1;
+	}
 	loop->me = thread.self();
 	loop->running = 1;
+	loop->node = -1;
+	loop->now_ns = timer.nsec();
+	loop->now = loop->now_ns / 1000000;
+#ifdef HAVE_SYS_EPOLL_H
+	loop->shared = backend == &eventpoll_shared;
+#endif
+	return 0;
+}
+
+
+static void eventloop_init(eventloop_t *loop) {
+	eventloop_init_backend(loop, &eventpoll);
 }
 
 
 static void eventloop_uninit(eventloop_t *loop) {
-	eventpoll.free(loop->poll);
+	alloc(loop->stats, 0);
+	alloc(loop->tasks, 0);
+	timewheel.free(loop->wheel);
+	loop->backend->free(loop->poll);
 }
 
 
-static eventloop_t *eventloop_new(void) {
+static eventloop_t *eventloop_new_backend(const struct eventpoll_ *backend) {
 	eventloop_t *loop = alloc(0, sizeof *loop);
 	if (!loop) {
 		return 0;
 	}
-	eventloop_init(loop);
+	if (eventloop_init_backend(loop, backend)) {
+		alloc(loop, 0);
+		return 0;
+	}
 	return loop;
 }
 
 
+static eventloop_t *eventloop_new(void) {
+	return eventloop_new_backend(&eventpoll);
+}
+
+
 static void eventloop_free(eventloop_t *loop) {
 	eventloop_uninit(loop);
 	alloc(loop, 0);
 }
 
-static void apply_panding(eventloop_t *loop, event_t *ev) {
-	lock.lock(&loop->panding_lock);
-	{
-		if (loop->pandings == loop->pandings_tail) {
-			loop->pandings = loop->pandings_tail = ev;
-		} else {
-			loop->pandings_tail->next = ev;
-			loop->pandings_tail = ev;
+static void notify(eventloop_t *loop) {
+	if (loop->me != thread.self() && !SYNC_SET(loop->signalled, 1)) {
+		loop->backend->wakeup(loop->poll);
+	}
+}
+
+static int klass(event_t *ev) {
+	return (unsigned)ev->prio < EVPRIO_CLASSES ? ev->prio : EVPRIO_NORMAL;
+}
+
+
+static void unready(eventloop_t *loop, event_t *ev) {
+	int c = klass(ev);
+	if (loop->ready_tail[c] == &ev->rnext) {
+		loop->ready_tail[c] = ev->rprev;
+	}
+	loop->nready--;
+	*ev->rprev = ev->rnext;
+	if (ev->rnext) {
+		ev->rnext->rprev = ev->rprev;
+	}
+	ev->rnext = 0;
+	ev->rprev = 0;
+	ev->rmask = 0;
+}
+
+
+static void eventloop_ready(eventloop_t *loop, event_t *ev, int mask) {
+	if (loop->shared) {
+		return;
+	}
+	if (!mask) {
+		if (ev->rprev) {
+			unready(loop, ev);
 		}
+		return;
+	}
+	ev->rmask |= mask;
+	if (!ev->rprev) {
+		int c = klass(ev);
+		ev->rprev = loop->ready_tail[c];
+		*loop->ready_tail[c] = ev;
+		loop->ready_tail[c] = &ev->rnext;
+		loop->nready++;
+	}
+}
+
+
+static void eventloop_set_class(eventloop_t *loop, int prio, int weight, int budget) {
+	if ((unsigned)prio >= EVPRIO_CLASSES || loop->shared) {
+		return;
 	}
-	lock.unlock(&loop->panding_lock);
+	loop->weight[prio] = max(weight, 1);
+	loop->budget[prio] = max(budget, 0);
+	loop->classes = 1;
 }
 
+
+static int apply_local(eventloop_t *loop, event_t *ev) {
+	if (ev->rprev && !(ev->mask & (EVMASK_READ | EVMASK_WRITE))) {
+		unready(loop, ev);
+	}
+	return loop->backend->apply(loop->poll, ev);
+}
+
+/* Events applied from other threads are queued lock-free, only the
+ * first producer after a drain pays for the wakeup syscall. */
 static int eventloop_apply(eventloop_t *loop, event_t *ev) {
+	if (loop->shared) {
+		return loop->backend->apply(loop->poll, ev);
+	}
 	if (loop->me == thread.self()) {
-		return eventpoll.apply(loop->poll, ev);
+		return apply_local(loop, ev);
+	}
+	if (__sync_bool_compare_and_swap(&ev->queued, 0, 1)) {
+		mpsc.push(&loop->pandings, &ev->node);
+	}
+	notify(loop);
+	return 0;
+}
+
+
+static void panding(eventloop_t *loop) {
+	mpscnode_t *node;
+	uint64_t n = 0;
+
+	(void)SYNC_SET(loop->signalled, 0);
+	while ((node = mpsc.pop(&loop->pandings))) {
+		event_t *ev = container_of(node, event_t, node);
+		(void)SYNC_SET(ev->queued, 0);
+		apply_local(loop, ev);
+		n++;
+	}
+	if (loop->stats && n) {
+		histogram.record(&loop->stats->pending, n);
+	}
+}
+
+/* The task ring is a bounded MPSC queue: each cell's seq says whose turn
+ * it is, producers claim cells by moving task_head with a CAS. */
+static int eventloop_post_many(eventloop_t *loop, const task_t *tasks, int n) {
+	unsigned pos, i;
+	struct _taskcell *cell;
+
+	if (n <= 0 || (unsigned)n > loop->task_mask + 1 || loop->shared) {
+		errno = EINVAL;
+		return -1;
+	}
+	pos = __atomic_load_n(&loop->task_head, __ATOMIC_RELAXED);
+	for (;;) {
+		unsigned last = pos + n - 1;
+		int diff;
+		cell = &loop->tasks[last & loop->task_mask];
+		diff = (int)(__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) - last);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&loop->task_head, &pos, pos + n, 1,
+						__ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if (diff < 0) {
+			errno = EAGAIN;
+			return -1;
+		} else {
+			pos = __atomic_load_n(&loop->task_head, __ATOMIC_RELAXED);
+		}
+	}
+	for (i = 0; i < (unsigned)n; i++) {
+		cell = &loop->tasks[(pos + i) & loop->task_mask];
+		cell->task = tasks[i];
+		__atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+	}
+	notify(loop);
+	return 0;
+}
+
+
+static int eventloop_post(eventloop_t *loop, task_pt fn, void *ud) {
+	task_t task = { fn, ud };
+	return eventloop_post_many(loop, &task, 1);
+}
+
+
+static int task_ready(eventloop_t *loop) {
+	struct _taskcell *cell = &loop->tasks[loop->task_tail & loop->task_mask];
+	return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == loop->task_tail + 1;
+}
+
+
+static void run_tasks(eventloop_t *loop) {
+	int budget = loop->task_budget;
+	while (budget-- > 0 && task_ready(loop)) {
+		struct _taskcell *cell = &loop->tasks[loop->task_tail & loop->task_mask];
+		task_t task = cell->task;
+		__atomic_store_n(&cell->seq, loop->task_tail + loop->task_mask + 1, __ATOMIC_RELEASE);
+		loop->task_tail++;
+		task.fn(loop, task.ud);
+	}
+}
+
+
+static void eventloop_busy_poll(eventloop_t *loop, int usec) {
+	loop->busy_poll = usec > 0 ? usec : 0;
+	loop->spin_window = loop->busy_poll;
+	loop->gap = 0;
+	loop->arrival = timer.usec();
+}
+
+
+static void adapt(eventloop_t *loop, int64_t now) {
+	loop->gap = (loop->gap * 7 + (now - loop->arrival)) / 8;
+	loop->arrival = now;
+	if (loop->gap < loop->busy_poll) {
+		loop->spin_window = min(loop->gap * 2 + 1, loop->busy_poll);
 	} else {
-		apply_panding(loop, ev);
-		eventpoll.wakeup(loop->poll);
+		loop->spin_window = loop->busy_poll / 16 + 1;
+	}
+}
+
+
+/* Busy polling trades cpu for latency: events arriving inside the spin
+ * window are picked up without the sleep and wakeup of a blocking wait. */
+static int poll_once(eventloop_t *loop, int timeout) {
+	int64_t now, deadline;
+	int ret;
+
+	if (timeout == 0) {
+		return loop->backend->poll(loop->poll, 0);
+	}
+	if (loop->busy_poll) {
+		now = timer.usec();
+		deadline = now + loop->spin_window;
+		do {
+			ret = loop->backend->poll(loop->poll, 0);
+			if (ret != 0) {
+				if (ret > 0) {
+					loop->spin_hits++;
+					adapt(loop, timer.usec());
+				}
+				return ret;
+			}
+		} while ((now = timer.usec()) < deadline && SYNC_GET(loop->running));
+	}
+	loop->blocks++;
+	ret = loop->backend->poll(loop->poll, timeout);
+	if (ret > 0 && loop->busy_poll) {
+		adapt(loop, timer.usec());
+	}
+	return ret;
+}
+
+
+/* Only the events queued before this pass run, events re-queued by their
+ * handler wait for the next pass so every ready event gets a turn. With
+ * classes, the pass is a deficit round-robin bounded by class budgets and
+ * what's left goes back in front of the ready lists. */
+static void run_ready(eventloop_t *loop) {
+	event_t *list[EVPRIO_CLASSES];
+	int c, progress, served[EVPRIO_CLASSES];
+
+	if (!loop->nready) {
+		return;
+	}
+	for (c = 0; c < EVPRIO_CLASSES; c++) {
+		list[c] = loop->ready[c];
+		if (list[c]) {
+			list[c]->rprev = &list[c];
+		}
+		loop->ready[c] = 0;
+		loop->ready_tail[c] = &loop->ready[c];
+		served[c] = 0;
+	}
+	do {
+		progress = 0;
+		for (c = 0; c < EVPRIO_CLASSES; c++) {
+			if (!list[c]) {
+				continue;
+			}
+			loop->deficit[c] += loop->weight[c];
+			while (list[c] && loop->deficit[c] > 0 && (!loop->budget[c] || served[c] < loop->budget[c])) {
+				event_t *ev = list[c];
+				int mask = ev->rmask;
+				unready(loop, ev);
+				ev->fired = mask;
+				loop->deficit[c]--;
+				served[c]++;
+				progress = 1;
+				dispatch(loop, ev);
+			}
+		}
+	} while (progress);
+
+	for (c = 0; c < EVPRIO_CLASSES; c++) {
+		event_t *tail = list[c];
+		if (!tail) {
+			loop->deficit[c] = 0;
+			continue;
+		}
+		loop->deficit[c] = min(loop->deficit[c], loop->weight[c]);
+		while (tail->rnext) {
+			tail = tail->rnext;
+		}
+		tail->rnext = loop->ready[c];
+		if (tail->rnext) {
+			tail->rnext->rprev = &tail->rnext;
+		} else {
+			loop->ready_tail[c] = &tail->rnext;
+		}
+		loop->ready[c] = list[c];
+		list[c]->rprev = &loop->ready[c];
+	}
+}
+
+
+static int eventloop_stats(eventloop_t *loop, int enable) {
+	if (!enable) {
+		alloc(loop->stats, 0);
+		loop->stats = 0;
 		return 0;
 	}
+	if (loop->shared) {
+		errno = EINVAL;
+		return -1;
+	}
+	if (!loop->stats) {
+		loop->stats = alloc(0, sizeof *loop->stats);
+		if (!loop->stats) {
+			return -1;
+		}
+	}
+	return 0;
 }
 
 
-static void panding(eventloop_t *loop) {
-	lock.lock(&loop->panding_lock);
-	{
-		event_t *ev = loop->pandings;
-		while (ev) {
-			loop->pandings = ev->next;
-			eventpoll.apply(loop->poll, ev);
-			ev = loop->pandings;
+/* Any number of threads may run a shared loop, they only poll. */
+static void shared_loop(eventloop_t *loop) {
+	while (SYNC_GET(loop->running)) {
+		if (loop->backend->poll(loop->poll, -1) < 0 && errno != EINTR) {
+			logger.err("eventloop error: %s\n", strerror(errno));
 		}
-		loop->pandings = loop->pandings_tail = 0;
 	}
-	lock.unlock(&loop->panding_lock);
 }
 
+
+static void tick(eventloop_t *loop) {
+	loop->now_ns = timer.nsec();
+	loop->now = loop->now_ns / 1000000;
+}
+
+
+/* The backend dispatches while it polls, so blocked time is measured up
+ * to the first dispatch and the rest of the poll counts as iteration. */
 static void eventloop_loop(eventloop_t *loop) {
+	int64_t start = 0, polled = 0;
 	int ret;
+	if (loop->shared) {
+		shared_loop(loop);
+		return;
+	}
+	tick(loop);
 	while (SYNC_GET(loop->running)) {
-		ret = eventpoll.poll(loop->poll);
-		if (ret == 0) {
-			logger.debug("eventloop timeout\n");
-		} else if (ret < 0) {
+		eventloop_stats_t *st = loop->stats;
+		if (st) {
+			/* carried over from the end of the previous iteration. */
+			if (!start) {
+				start = timer.usec();
+			}
+			loop->polled = 0;
+		}
+		ret = poll_once(loop, task_ready(loop) || loop->nready ? 0 : timewheel.next(loop->wheel));
+		if (ret < 0 && errno != EINTR) {
 			logger.err("eventloop error: %s\n", strerror(errno));
 		}
+		tick(loop);
+		if (st) {
+			polled = loop->polled ? loop->polled : loop->now_ns / 1000;
+			histogram.record(&st->blocked, polled - start);
+			if (ret > 0) {
+				STAT_INC(st->wakeups, 1);
+				histogram.record(&st->batch, ret);
+			}
+		}
+		timewheel.update(loop->wheel, loop->now);
 		panding(loop);
+		run_ready(loop);
+		run_tasks(loop);
+		loop->iteration++;
+		start = 0;
+		if (st && st == loop->stats) {
+			start = timer.usec();
+			histogram.record(&st->iteration, start - polled);
+			STAT_INC(st->iterations, 1);
+		}
 	}
 }
 
 
 static void eventloop_exit(eventloop_t *loop) {
 	SYNC_SET(loop->running, 0);
+	if (loop->shared || loop->me != thread.self()) {
+		loop->backend->wakeup(loop->poll);
+	}
+}
+
+
+static void eventloop_timeout(eventloop_t *loop, timeout_t *to, uint32_t ms) {
+	timewheel.add(loop->wheel, to, loop->now + ms);
+}
+
+
+static int64_t eventloop_now(eventloop_t *loop) {
+	return loop->shared ? timer.now() : loop->now;
+}
+
+
+/* The backend forgets a change still pending for the event, so nothing
+ * refers to it once it's memory is released. */
+static void eventloop_detach(eventloop_t *loop, event_t *ev) {
+	ev->mask = EVMASK_NONE;
+	if (!loop->shared && ev->rprev) {
+		unready(loop, ev);
+	}
+	loop->backend->apply(loop->poll, ev);
+}
+
+
+static void eventloop_cancel(eventloop_t *loop, timeout_t *to) {
+	timewheel.cancel(loop->wheel, to);
 }
 
 struct eventloop_ eventloop = {
 	eventloop_new,
+	eventloop_new_backend,
 	eventloop_free,
 	eventloop_init,
 	eventloop_uninit,
 	eventloop_apply,
 	eventloop_loop,
-	eventloop_exit
+	eventloop_exit,
+	eventloop_timeout,
+	eventloop_cancel,
+	eventloop_post,
+	eventloop_post_many,
+	eventloop_busy_poll,
+	eventloop_ready,
+	eventloop_stats,
+	eventloop_set_class,
+	eventloop_now,
+	eventloop_detach
 };
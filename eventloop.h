@@ -2,31 +2,184 @@
 #define EVENTLOOP_H
 
 #include "eventpoll.h"
+#include "histogram.h"
 #include "lock.h"
 #include "thread.h"
+#include "timewheel.h"
 
 
 #ifdef __cplusplus
 extern "C"{
 #endif
 
+#define EVENTLOOP_TASKS_P		10
+#define EVENTLOOP_TASK_BUDGET	256
+#define EVENTLOOP_READ_BUDGET	(256 * 1024)
+#define EVENTLOOP_ACCEPT_BUDGET	64
+#define EVENTLOOP_STAT_LABELS	16
+
+typedef void (*task_pt)(struct _eventloop *loop, void *ud);
+
+typedef struct _task {
+	task_pt fn;
+	void *ud;
+} task_t;
+
+struct _taskcell;
+
+/* Written by the loop thread only, readable from any thread with
+ * relaxed loads or the histogram functions. Times are in us. */
+typedef struct _eventloop_stats {
+	uint64_t iterations;
+	uint64_t wakeups;		/* polls that returned events. */
+	uint64_t dispatches;
+	histogram_t blocked;	/* time spent in the backend poll. */
+	histogram_t batch;		/* events per wakeup. */
+	histogram_t pending;	/* events applied by one drain of cross-thread applies. */
+	histogram_t iteration;	/* time from poll return to the end of the iteration. */
+	histogram_t other;		/* dispatch time of labels past EVENTLOOP_STAT_LABELS. */
+	struct {
+		uintptr_t key;		/* ev->label or ev->cb, 0 for a free slot. */
+		const char *label;
+		histogram_t dispatch;
+	} labels[EVENTLOOP_STAT_LABELS];
+} eventloop_stats_t;
+
 typedef struct _eventloop {
+	const struct eventpoll_ *backend;
 	eventpoll_t *poll;
 	int running;
-	event_t *pandings;
-	event_t *pandings_tail;
-	lock_t panding_lock;
+	mpsc_t pandings;
+	int signalled;
 	thread_t *me;
+	timewheel_t *wheel;
+	int nsocks;
+	struct _taskcell *tasks;
+	unsigned task_mask;
+	unsigned task_head;
+	unsigned task_tail;
+	int task_budget;	/* tasks run per iteration, default EVENTLOOP_TASK_BUDGET */
+	int busy_poll;		/* max spin window in us, 0 disable. */
+	int64_t spin_window;
+	int64_t arrival, gap;
+	uint64_t spin_hits;	/* polls served while spinning. */
+	uint64_t blocks;	/* polls that went to a blocking wait. */
+	event_t *ready[EVPRIO_CLASSES], **ready_tail[EVPRIO_CLASSES];
+	int nready;
+	int classes;	/* 1 once set_class was called. */
+	int weight[EVPRIO_CLASSES];		/* dispatches per round, default 4, 2, 1. */
+	int budget[EVPRIO_CLASSES];		/* dispatches per iteration, 0 no limit. */
+	int deficit[EVPRIO_CLASSES];
+	int read_budget;	/* bytes read per event and iteration. */
+	int accept_budget;	/* connections accepted per event and iteration. */
+	uint64_t iteration;
+	eventloop_stats_t *stats;
+	int64_t polled;		/* first dispatch of the current poll, with stats. */
+	int shared;		/* on eventpoll_shared, see new_backend. */
+	int node;		/* NUMA node of a pinned loop thread, -1 if not pinned. */
+	int64_t now;	/* timer.now when the last poll returned. */
+	int64_t now_ns;	/* timer.nsec when the last poll returned. */
+	int accounting;	/* time socket callbacks, see loopgroup.rebalance. */
+	uint64_t epoch;
+	int64_t busy;	/* us spent in accounted socket callbacks. */
+	event_t *hot;	/* socket with the most cpu in the epoch. */
+	int64_t hot_cpu;
 } eventloop_t;
 
-struct eventloop_ {
+extern struct eventloop_ {
 	eventloop_t *(*new)(void);
+
+	/** Create a loop on a specify eventpoll backend, return 0 if the backend
+	 *  is unavailable.
+	 *
+	 *  A loop on eventpoll_shared may be run by several threads at once, an
+	 *  idle thread picks up any ready event. Such a loop only polls: apply
+	 *  is safe from any thread and re-arms the event, while timeouts, post,
+	 *  ready lists, classes and stats are not available.
+	 */
+	eventloop_t *(*new_backend)(const struct eventpoll_ *backend);
+
 	void (*free)(eventloop_t *loop);
 	void (*init)(eventloop_t *loop);
 	void (*uninit)(eventloop_t *loop);
 	int (*apply)(eventloop_t *loop, event_t *ev);
 	void (*loop)(eventloop_t *loop);
 	void (*exit)(eventloop_t *loop);
+
+	/** Schedule or reschedule a timeout ms from eventloop.now, loop thread only. */
+	void (*timeout)(eventloop_t *loop, timeout_t *to, uint32_t ms);
+
+	/** Cancel a timeout, loop thread only. */
+	void (*cancel)(eventloop_t *loop, timeout_t *to);
+
+	/**
+	 * Run fn(loop, ud) on the loop thread, safe from any thread.
+	 *
+	 * Tasks go to a ring of 1 << EVENTLOOP_TASKS_P slots allocated with the
+	 * loop, so posting never allocates. They run in post order between two
+	 * polls, at most task_budget per iteration. Return -1 with EAGAIN if
+	 * the ring is full.
+	 */
+	int (*post)(eventloop_t *loop, task_pt fn, void *ud);
+
+	/** Post n tasks at once, all or none, with a single wakeup. */
+	int (*post_many)(eventloop_t *loop, const task_t *tasks, int n);
+
+	/**
+	 * Spin on non-blocking polls for up to usec before blocking, 0 disable.
+	 *
+	 * The spin window adapts to the observed inter-arrival time of events:
+	 * about twice the average gap while it stays under usec, a short probe
+	 * otherwise. Hits and blocking waits are counted in spin_hits and blocks.
+	 */
+	void (*busy_poll)(eventloop_t *loop, int usec);
+
+	/**
+	 * Dispatch ev again with mask before the next blocking poll, loop thread
+	 * only. A mask of 0 takes ev off the ready list.
+	 *
+	 * Edge triggered handlers that stopped draining on their budget use this
+	 * to resume once every other ready event had it's turn.
+	 */
+	void (*ready)(eventloop_t *loop, event_t *ev, int mask);
+
+	/**
+	 * Enable or disable loop->stats, before the loop runs or on it's thread.
+	 *
+	 * Disabled by default, it costs two clock reads per dispatch. Dispatch
+	 * times are grouped by ev->label, or ev->cb for unlabeled events. The
+	 * stats are freed when disabled, stop readers first.
+	 */
+	int (*stats)(eventloop_t *loop, int enable);
+
+	/**
+	 * Set the weight and budget of a dispatch class, see ev->prio.
+	 *
+	 * Once called, polled events are not dispatched in kernel order but
+	 * queued by class and served with deficit round-robin: each round a
+	 * class may dispatch weight events, classes are visited from
+	 * EVPRIO_HIGH down, and a class stops for the iteration once it
+	 * dispatched budget events. Leftovers run first on the next iteration.
+	 * Loop thread only, or before the loop runs.
+	 */
+	void (*set_class)(eventloop_t *loop, int prio, int weight, int budget);
+
+	/**
+	 * Return timer.now as read once per iteration, when the poll returned.
+	 *
+	 * Handlers stamping activity or arming timeouts use this instead of a
+	 * clock call each, it lags the clock by the handlers run before in
+	 * the iteration. A shared loop reads the clock.
+	 */
+	int64_t (*now)(eventloop_t *loop);
+
+	/**
+	 * Drop the interest of ev and take it off the ready list and the
+	 * backend's pending changes, before the memory of ev is released.
+	 * Call on the loop thread or once the loop stopped, with no apply
+	 * of ev queued from another thread.
+	 */
+	void (*detach)(eventloop_t *loop, event_t *ev);
 } eventloop;
 
 #ifdef __cplusplus
@@ -3,6 +3,8 @@
 
 #include "event.h"
 
+#include <sys/uio.h>
+
 #ifdef __cplusplus
 extern "C"{
 #endif
@@ -10,14 +12,64 @@ extern "C"{
 typedef struct _eventpoll eventpoll_t;
 typedef void (*dispatch_pt)(eventpoll_t *poll, event_t *ev, void *ud);
 
+typedef struct _eventio eventio_t;
+typedef void (*eventio_pt)(eventio_t *io);
+
+/* An I/O done by the backend itself, completed by a call to cb on the
+ * polling thread. */
+struct _eventio {
+	int fd;
+	int res;	/* bytes transferred, 0 on EOF or -errno. */
+	int more;	/* a recv stays armed after this completion. */
+	void *data;	/* bytes received, valid until cb returns. */
+	eventio_pt cb;
+	void *ud;
+};
+
 extern struct eventpoll_ {
 	eventpoll_t *(*new)(dispatch_pt f, void *ud);
 	void (*free)(eventpoll_t *poll);
+
+	/** Apply ev->mask. Changes may be held until the next poll, removing
+	 *  the interest always takes effect at once.
+	 */
 	int (*apply)(eventpoll_t *poll, event_t *ev);
 	void (*wakeup)(eventpoll_t *poll);
-	int (*poll)(eventpoll_t *poll);
+	int (*poll)(eventpoll_t *poll, int timeout);
+
+	/**
+	 * Arm a recv on io->fd into buffers of the backend, 0 if the backend
+	 * only polls. io->cb runs for every arrival until io->more is 0, on
+	 * EOF, error or cancel. Return -1 with ENOTSUP when the kernel lacks
+	 * it, the fd is then polled as usual.
+	 */
+	int (*recv)(eventpoll_t *poll, eventio_t *io);
+
+	/** Queue a writev to io->fd, 0 if the backend only polls. iov and the
+	 *  bytes stay in use until io->cb runs. */
+	int (*writev)(eventpoll_t *poll, eventio_t *io, const struct iovec *iov, int iovcnt);
+
+	/** Cancel io, it's callback still runs with the result or -ECANCELED. */
+	int (*cancel)(eventpoll_t *poll, eventio_t *io);
+
+	/** Submit queued I/O at once, before a fd it refers to is closed. */
+	int (*submit)(eventpoll_t *poll);
 } eventpoll;
 
+/** io_uring backend, new returns 0 when the kernel can not provide it.
+ *  It provides recv, writev and cancel, submitted with the next poll. */
+extern struct eventpoll_ eventpoll_uring;
+
+/**
+ * epoll backend polled by several threads at once.
+ *
+ * Events are level triggered and EPOLLONESHOT, so a ready event goes to
+ * exactly one thread and stays disarmed until it is applied again. apply
+ * takes effect at once and is safe from any thread, wakeup makes every
+ * poller return until the poll is freed.
+ */
+extern struct eventpoll_ eventpoll_shared;
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,620 @@
+#include "_.h"
+#include "fmt.h"
+
+#include <math.h>
+
+#define FMT_ARG			-2
+#define FMT_WIDTH_MAX	(1 << 20)
+#define FMT_FIXED_PREC	15
+
+#define FLAGS		"-+ #0"
+
+#define F_MINUS		0x01
+#define F_PLUS		0x02
+#define F_SPACE		0x04
+#define F_ALT		0x08
+#define F_ZERO		0x10
+
+enum {
+	S_INT,
+	S_HH,
+	S_H,
+	S_L,
+	S_LL,
+	S_Z,
+	S_J,
+	S_T
+};
+
+/* A conversion with it's argument and the width and precision taken
+ * from the arguments resolved. */
+typedef struct _arg {
+	int width;
+	int prec;
+	int flags;
+	int neg;
+	size_t len;			/* of a string. */
+	union {
+		uint64_t u;
+		double d;
+		const char *s;
+	} v;
+} arg_t;
+
+static const char pairs[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+static const uint64_t pow10u[20] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL, 1000000000000000000ULL, 10000000000000000000ULL
+};
+
+
+static int ndigits(uint64_t v, int base) {
+	int bits = 64 - __builtin_clzll(v | 1), n;
+	if (base == 16) {
+		return (bits + 3) >> 2;
+	} else if (base == 8) {
+		return (bits + 2) / 3;
+	}
+	n = (bits * 1233) >> 12;
+	return n + ((v | 1) >= pow10u[n]);
+}
+
+
+/* Write the digits of v backwards, ending at end. */
+static void put_digits(char *end, uint64_t v, int base, int upper) {
+	const char *xdigits = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+
+	if (base == 10) {
+		while (v >= 100) {
+			end -= 2;
+			memcpy(end, pairs + (v % 100) * 2, 2);
+			v /= 100;
+		}
+		if (v >= 10) {
+			memcpy(end - 2, pairs + v * 2, 2);
+		} else {
+			end[-1] = '0' + v;
+		}
+		return;
+	}
+	do {
+		*--end = xdigits[v & (base - 1)];
+		v >>= base == 16 ? 4 : 3;
+	} while (v);
+}
+
+
+static char *fmt_u64(char *dst, uint64_t v) {
+	int n = ndigits(v, 10);
+	put_digits(dst + n, v, 10, 0);
+	return dst + n;
+}
+
+
+static char *fmt_i64(char *dst, int64_t v) {
+	if (v < 0) {
+		*dst++ = '-';
+		return fmt_u64(dst, 0 - (uint64_t)v);
+	}
+	return fmt_u64(dst, v);
+}
+
+
+static char *fmt_hex(char *dst, uint64_t v, int upper) {
+	int n = ndigits(v, 16);
+	put_digits(dst + n, v, 16, upper);
+	return dst + n;
+}
+
+
+/* v * 10^prec is rounded to an integer, snprintf rounds the exact binary
+ * value half to even. The product is off by half an ulp at most, so
+ * unless its fraction is that close to a half, rounding it gives the
+ * same digits. */
+static char *fixed(char *dst, double v, int prec) {
+	double s = v * (double)pow10u[prec], frac;
+	uint64_t q, ip;
+
+	if (!(s < 0x1p50)) {
+		return 0;
+	}
+	q = (uint64_t)s;
+	frac = s - (double)q;
+	if ((frac > 0.5 ? frac - 0.5 : 0.5 - frac) <= s * 0x1p-52) {
+		return 0;
+	}
+	q += frac > 0.5;
+	ip = q / pow10u[prec];
+	dst = fmt_u64(dst, ip);
+	if (prec) {
+		*dst++ = '.';
+		memset(dst, '0', prec);
+		q -= ip * pow10u[prec];
+		if (q) {
+			put_digits(dst + prec, q, 10, 0);
+		}
+		dst += prec;
+	}
+	return dst;
+}
+
+
+static char *fmt_dbl(char *dst, double v, int prec) {
+	char *p = dst;
+
+	if (prec < 0 || prec > FMT_FIXED_PREC || !isfinite(v)) {
+		return 0;
+	}
+	if (signbit(v)) {
+		*p++ = '-';
+		v = -v;
+	}
+	return fixed(p, v, prec);
+}
+
+
+static int number(const char **pp, int *val) {
+	const char *p = *pp;
+	int n = 0;
+
+	while (*p >= '0' && *p <= '9') {
+		n = n * 10 + (*p++ - '0');
+		if (n > FMT_WIDTH_MAX) {
+			return -1;
+		}
+	}
+	if (*p == '$') {
+		return -1;
+	}
+	*pp = p;
+	*val = n;
+	return 0;
+}
+
+
+/* Parse the conversion after a '%', return the byte after it or 0 if
+ * the plan can't handle it. */
+static const char *spec(fmt_op_t *op, const char *p) {
+	const char *flag;
+
+	while (*p && (flag = strchr(FLAGS, *p))) {
+		op->flags |= 1 << (flag - FLAGS);
+		p++;
+	}
+	if (*p == '*') {
+		op->width = FMT_ARG;
+		if (*++p >= '0' && *p <= '9') {
+			return 0;
+		}
+	} else if (*p >= '0' && *p <= '9' && number(&p, &op->width)) {
+		return 0;
+	}
+	if (*p == '.') {
+		if (*++p == '*') {
+			op->prec = FMT_ARG;
+			if (*++p >= '0' && *p <= '9') {
+				return 0;
+			}
+		} else if (number(&p, &op->prec)) {
+			return 0;
+		}
+	}
+	if (*p == 'h') {
+		op->size = *++p == 'h' ? S_HH : S_H;
+		p += op->size == S_HH;
+	} else if (*p == 'l') {
+		op->size = *++p == 'l' ? S_LL : S_L;
+		p += op->size == S_LL;
+	} else if (*p == 'z') {
+		op->size = S_Z;
+		p++;
+	} else if (*p == 'j') {
+		op->size = S_J;
+		p++;
+	} else if (*p == 't') {
+		op->size = S_T;
+		p++;
+	}
+	if (!*p || !strchr("diouxXcspfFeEgGaA", *p)) {
+		return 0;
+	}
+	if (op->size == S_L && (*p == 'c' || *p == 's')) {
+		return 0;
+	}
+	if (*p == 'o' && (op->flags & F_ALT)) {
+		return 0;
+	}
+	op->conv = *p;
+	return p + 1;
+}
+
+
+static fmt_op_t *add_op(fmt_t *f, const char *lit, size_t len) {
+	fmt_op_t *op;
+
+	if (f->n == FMT_OPS) {
+		f->n = -1;
+		return 0;
+	}
+	op = &f->op[f->n++];
+	op->off = lit - f->str;
+	op->len = len;
+	op->conv = 0;
+	op->size = S_INT;
+	op->flags = 0;
+	op->width = op->prec = -1;
+	return op;
+}
+
+
+static int fmt_parse(fmt_t *f, const char *format) {
+	const char *lit = format, *p;
+	fmt_op_t *op;
+
+	f->str = format;
+	f->n = 0;
+	while ((p = strchr(lit, '%'))) {
+		if (!(op = add_op(f, lit, p - lit))) {
+			return -1;
+		}
+		if (p[1] == '%') {
+			op->len++;
+			lit = p + 2;
+			continue;
+		}
+		if (!(lit = spec(op, p + 1))) {
+			f->n = -1;
+			return -1;
+		}
+	}
+	if (*lit && !add_op(f, lit, strlen(lit))) {
+		return -1;
+	}
+	return 0;
+}
+
+
+static fmt_t *fmt_new(const char *format) {
+	size_t len = strlen(format) + 1;
+	fmt_t *f = alloc(0, sizeof *f + len);
+
+	if (!f) {
+		errno = ENOMEM;
+		return 0;
+	}
+	memcpy(f + 1, format, len);
+	fmt_parse(f, (const char *)(f + 1));
+	return f;
+}
+
+
+static void fmt_free(fmt_t *f) {
+	alloc(f, 0);
+}
+
+
+static int64_t signed_arg(int size, va_list *ap) {
+	switch (size) {
+		case S_HH:
+			return (signed char)va_arg(*ap, int);
+		case S_H:
+			return (short)va_arg(*ap, int);
+		case S_L:
+			return va_arg(*ap, long);
+		case S_LL:
+			return va_arg(*ap, long long);
+		case S_Z:
+			return va_arg(*ap, ssize_t);
+		case S_J:
+			return va_arg(*ap, intmax_t);
+		case S_T:
+			return va_arg(*ap, ptrdiff_t);
+	}
+	return va_arg(*ap, int);
+}
+
+
+static uint64_t unsigned_arg(int size, va_list *ap) {
+	switch (size) {
+		case S_HH:
+			return (unsigned char)va_arg(*ap, unsigned);
+		case S_H:
+			return (unsigned short)va_arg(*ap, unsigned);
+		case S_L:
+			return va_arg(*ap, unsigned long);
+		case S_LL:
+			return va_arg(*ap, unsigned long long);
+		case S_Z:
+			return va_arg(*ap, size_t);
+		case S_J:
+			return va_arg(*ap, uintmax_t);
+		case S_T:
+			return (size_t)va_arg(*ap, ptrdiff_t);
+	}
+	return va_arg(*ap, unsigned);
+}
+
+
+static void fetch(const fmt_op_t *op, arg_t *a, va_list *ap) {
+	int64_t i;
+
+	a->flags = op->flags;
+	a->width = op->width;
+	a->prec = op->prec;
+	a->neg = 0;
+	if (a->width == FMT_ARG) {
+		a->width = va_arg(*ap, int);
+		if (a->width < 0) {
+			a->flags |= F_MINUS;
+			a->width = (int)(0U - (unsigned)a->width);
+		}
+	}
+	if (a->prec == FMT_ARG) {
+		a->prec = va_arg(*ap, int);
+		a->prec = max(a->prec, -1);
+	}
+	switch (op->conv) {
+		case 'd':
+		case 'i':
+			i = signed_arg(op->size, ap);
+			a->neg = i < 0;
+			a->v.u = a->neg ? 0 - (uint64_t)i : (uint64_t)i;
+			break;
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+			a->v.u = unsigned_arg(op->size, ap);
+			break;
+		case 'c':
+			a->v.u = (unsigned char)va_arg(*ap, int);
+			break;
+		case 'p':
+			a->v.u = (uintptr_t)va_arg(*ap, void *);
+			break;
+		case 's':
+			a->v.s = va_arg(*ap, const char *);
+			if (!a->v.s) {
+				a->v.s = a->prec < 0 || a->prec >= 6 ? "(null)" : "";
+			}
+			a->len = a->prec >= 0 ? strnlen(a->v.s, a->prec) : strlen(a->v.s);
+			break;
+		default:
+			a->v.d = va_arg(*ap, double);
+			break;
+	}
+}
+
+
+static size_t op_bound(const fmt_op_t *op, const arg_t *a) {
+	int prec = a->prec < 0 ? 6 : a->prec;
+	size_t n;
+
+	switch (op->conv) {
+		case 's':
+			n = a->len;
+			break;
+		case 'c':
+			n = 1;
+			break;
+		case 'd':
+		case 'i':
+		case 'o':
+		case 'u':
+		case 'x':
+		case 'X':
+		case 'p':
+			n = max(a->prec, 22) + 3;
+			break;
+		case 'f':
+		case 'F':
+			n = (isfinite(a->v.d) && a->v.d < 1e17 && a->v.d > -1e17 ? 19 : 312) + (size_t)prec;
+			break;
+		default:
+			n = max(a->prec, 17) + 16;
+			break;
+	}
+	return max(n, (size_t)max(a->width, 0));
+}
+
+
+/* Lay out spaces, prefix, zeros, body and spaces, the body is left for
+ * the caller to fill at *body. */
+static char *lay(char *p, const arg_t *a, const char *pre, int plen, int zeros, size_t blen, char **body) {
+	long pad = (long)a->width - plen - zeros - (long)blen;
+
+	if (pad > 0 && !(a->flags & F_MINUS)) {
+		memset(p, ' ', pad);
+		p += pad;
+	}
+	while (plen--) {
+		*p++ = *pre++;
+	}
+	if (zeros) {
+		memset(p, '0', zeros);
+		p += zeros;
+	}
+	*body = p;
+	p += blen;
+	if (pad > 0 && (a->flags & F_MINUS)) {
+		memset(p, ' ', pad);
+		p += pad;
+	}
+	return p;
+}
+
+
+static int zero_fill(const arg_t *a, int plen, int zeros, size_t blen) {
+	if ((a->flags & (F_ZERO | F_MINUS)) == F_ZERO && (long)a->width > plen + zeros + (long)blen) {
+		return a->width - plen - blen;
+	}
+	return zeros;
+}
+
+
+static char *put_str(char *p, const arg_t *a, const char *s, size_t len) {
+	char *body;
+	p = lay(p, a, "", 0, 0, len, &body);
+	memcpy(body, s, len);
+	return p;
+}
+
+
+static char *put_int(char *p, const fmt_op_t *op, const arg_t *a) {
+	int base = 10, plen = 0, n, zeros;
+	char pre[3], *body;
+
+	if (op->conv == 'x' || op->conv == 'X' || op->conv == 'p') {
+		base = 16;
+	} else if (op->conv == 'o') {
+		base = 8;
+	}
+	if (a->neg) {
+		pre[plen++] = '-';
+	} else if (op->conv == 'd' || op->conv == 'i' || op->conv == 'p') {
+		if (a->flags & F_PLUS) {
+			pre[plen++] = '+';
+		} else if (a->flags & F_SPACE) {
+			pre[plen++] = ' ';
+		}
+	}
+	if (base == 16 && a->v.u && (op->conv == 'p' || (a->flags & F_ALT))) {
+		pre[plen++] = '0';
+		pre[plen++] = op->conv == 'X' ? 'X' : 'x';
+	}
+	n = a->prec == 0 && a->v.u == 0 ? 0 : ndigits(a->v.u, base);
+	zeros = a->prec > n ? a->prec - n : 0;
+	if (a->prec < 0) {
+		zeros = zero_fill(a, plen, zeros, n);
+	}
+	p = lay(p, a, pre, plen, zeros, n, &body);
+	if (n) {
+		put_digits(body + n, a->v.u, base, op->conv == 'X');
+	}
+	return p;
+}
+
+
+static char *put_dbl(char *p, const fmt_op_t *op, const arg_t *a) {
+	char spec[16], tmp[40], *s = spec, *end = 0, *body;
+	double v = a->v.d;
+	int prec = a->prec < 0 ? 6 : a->prec, plen = 0, i;
+	const char *pre = "";
+
+	if ((op->conv == 'f' || op->conv == 'F') && !(a->flags & F_ALT) && prec <= FMT_FIXED_PREC && isfinite(v)) {
+		if (signbit(v)) {
+			pre = "-";
+			v = -v;
+		} else if (a->flags & F_PLUS) {
+			pre = "+";
+		} else if (a->flags & F_SPACE) {
+			pre = " ";
+		}
+		plen = *pre != 0;
+		end = fixed(tmp, v, prec);
+	}
+	if (end) {
+		p = lay(p, a, pre, plen, zero_fill(a, plen, 0, end - tmp), end - tmp, &body);
+		memcpy(body, tmp, end - tmp);
+		return p;
+	}
+	*s++ = '%';
+	for (i = 0; FLAGS[i]; i++) {
+		if (a->flags & (1 << i)) {
+			*s++ = FLAGS[i];
+		}
+	}
+	*s++ = '*';
+	*s++ = '.';
+	*s++ = '*';
+	*s++ = op->conv;
+	*s = 0;
+	return p + snprintf(p, op_bound(op, a) + 1, spec, max(a->width, 0), a->prec, a->v.d);
+}
+
+
+static size_t fmt_bound(const fmt_t *f, va_list ap) {
+	size_t n = 1;
+	va_list args;
+	arg_t a;
+	int i;
+
+	va_copy(args, ap);
+	for (i = 0; i < f->n; i++) {
+		n += f->op[i].len;
+		if (f->op[i].conv) {
+			fetch(&f->op[i], &a, &args);
+			n += op_bound(&f->op[i], &a);
+		}
+	}
+	va_end(args);
+	return n;
+}
+
+
+static uint32_t fmt_vformat(char *dst, const fmt_t *f, va_list ap) {
+	const fmt_op_t *op;
+	char *p = dst, c;
+	va_list args;
+	arg_t a;
+	int i;
+
+	va_copy(args, ap);
+	for (i = 0; i < f->n; i++) {
+		op = &f->op[i];
+		memcpy(p, f->str + op->off, op->len);
+		p += op->len;
+		if (!op->conv) {
+			continue;
+		}
+		fetch(op, &a, &args);
+		switch (op->conv) {
+			case 's':
+				p = put_str(p, &a, a.v.s, a.len);
+				break;
+			case 'c':
+				c = (char)a.v.u;
+				p = put_str(p, &a, &c, 1);
+				break;
+			case 'p':
+				p = a.v.u ? put_int(p, op, &a) : put_str(p, &a, "(nil)", 5);
+				break;
+			case 'd':
+			case 'i':
+			case 'o':
+			case 'u':
+			case 'x':
+			case 'X':
+				p = put_int(p, op, &a);
+				break;
+			default:
+				p = put_dbl(p, op, &a);
+				break;
+		}
+	}
+	va_end(args);
+	*p = 0;
+	return p - dst;
+}
+
+
+struct fmt_ fmt = {
+	fmt_parse,
+	fmt_new,
+	fmt_free,
+	fmt_bound,
+	fmt_vformat,
+	fmt_u64,
+	fmt_i64,
+	fmt_hex,
+	fmt_dbl
+};
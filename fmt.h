@@ -0,0 +1,96 @@
+/**
+ * #Fmt
+ *
+ * printf formatting without vsnprintf for the common conversions.
+ *
+ * A format is parsed once into a plan of literal runs and conversions.
+ * bound walks the arguments once for an upper bound of the output, so a
+ * buffer reserves enough space up front and vformat writes every byte
+ * exactly once, integers with a digit pair table and %f in fixed point.
+ * Output is byte for byte what snprintf produces, %e, %g, %a and the %f
+ * values the fixed point path can't round exactly are handed to
+ * snprintf one conversion at a time.
+ *
+ * Plans are read only once parsed and may be shared by threads.
+ *
+ */
+
+#ifndef FMT_H
+#define FMT_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdarg.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define FMT_OPS		32
+
+/* A literal run followed by a conversion, conv is 0 for a run alone. */
+typedef struct _fmt_op {
+	uint32_t off;
+	uint32_t len;
+	char conv;
+	uint8_t size;
+	uint8_t flags;
+	int width;			/* -1 none, -2 from an argument. */
+	int prec;			/* -1 none, -2 from an argument. */
+} fmt_op_t;
+
+typedef struct _fmt {
+	const char *str;
+	int n;				/* -1 if the plan formats with vsnprintf. */
+	fmt_op_t op[FMT_OPS];
+} fmt_t;
+
+extern struct fmt_ {
+	/**
+	 * Parse a printf format into f, format must outlive f.
+	 *
+	 * Return -1 if format uses what the plan does not handle: positional
+	 * arguments, %n, %m, long double, wide characters, the ' flag or more
+	 * than FMT_OPS conversions. f->n is -1 then and the users of f fall
+	 * back to vsnprintf.
+	 */
+	int (*parse)(fmt_t *f, const char *format);
+
+	/** Parse a copy of format into a new plan, for buffer.format. Return
+	 *  0 with ENOMEM on failure, a plan that falls back is still one. */
+	fmt_t *(*new)(const char *format);
+
+	/** Free a plan of new. */
+	void (*free)(fmt_t *f);
+
+	/** Return an upper bound of the output of f with ap, NUL included. */
+	size_t (*bound)(const fmt_t *f, va_list ap);
+
+	/** Format into dst of at least bound bytes, NUL terminated. Return
+	 *  the length, the plan must not fall back. */
+	uint32_t (*vformat)(char *dst, const fmt_t *f, va_list ap);
+
+	/** Write the decimal digits of v, return the end. */
+	char *(*u64)(char *dst, uint64_t v);
+
+	/** Write v in decimal with a leading '-' if negative, return the end. */
+	char *(*i64)(char *dst, int64_t v);
+
+	/** Write the hex digits of v, upper case if upper, return the end. */
+	char *(*hex)(char *dst, uint64_t v, int upper);
+
+	/**
+	 * Write v like %.*f with prec up to 15, return the end.
+	 *
+	 * Return 0 when the result might not be rounded like snprintf: v is
+	 * not finite, v * 10^prec is 2^50 or more, or it lies too close to a
+	 * half for double precision to tell. At most 18 + prec bytes.
+	 */
+	char *(*dbl)(char *dst, double v, int prec);
+} fmt;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // FMT_H
@@ -0,0 +1,97 @@
+#include "_.h"
+#include "histogram.h"
+
+#define HIST_LINEAR		16
+#define HIST_SUB_BITS	3
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+
+static int bucket(uint64_t v) {
+	int e;
+	if (v < HIST_LINEAR) {
+		return (int)v;
+	}
+	e = 63 - __builtin_clzll(v);
+	return HIST_LINEAR + ((e - 4) << HIST_SUB_BITS) + (int)((v >> (e - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+
+static uint64_t bucket_top(int b) {
+	int e, sub;
+	if (b < HIST_LINEAR) {
+		return b;
+	}
+	e = ((b - HIST_LINEAR) >> HIST_SUB_BITS) + 4;
+	sub = (b - HIST_LINEAR) & ((1 << HIST_SUB_BITS) - 1);
+	return ((uint64_t)((1 << HIST_SUB_BITS) + sub + 1) << (e - HIST_SUB_BITS)) - 1;
+}
+
+
+static void histogram_init(histogram_t *h) {
+	memset(h, 0, sizeof *h);
+}
+
+
+/* Single writer: plain read-modify-write, relaxed stores keep
+ * concurrent readers free of torn values. */
+static void histogram_record(histogram_t *h, uint64_t v) {
+	int b = bucket(v);
+	STORE(h->buckets[b], h->buckets[b] + 1);
+	STORE(h->sum, h->sum + v);
+	if (v > h->max) {
+		STORE(h->max, v);
+	}
+	STORE(h->count, h->count + 1);
+}
+
+
+static uint64_t histogram_count(const histogram_t *h) {
+	return LOAD(h->count);
+}
+
+
+static uint64_t histogram_mean(const histogram_t *h) {
+	uint64_t n = LOAD(h->count);
+	return n ? LOAD(h->sum) / n : 0;
+}
+
+
+static uint64_t histogram_highest(const histogram_t *h) {
+	return LOAD(h->max);
+}
+
+
+static uint64_t histogram_percentile(const histogram_t *h, double p) {
+	uint64_t total = 0, rank, seen = 0;
+	int b;
+
+	for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		total += LOAD(h->buckets[b]);
+	}
+	if (total == 0) {
+		return 0;
+	}
+	rank = (uint64_t)(total * (p < 0 ? 0 : p > 100 ? 100 : p) / 100);
+	if (rank == 0) {
+		rank = 1;
+	}
+	for (b = 0; b < HISTOGRAM_BUCKETS; b++) {
+		seen += LOAD(h->buckets[b]);
+		if (seen >= rank) {
+			break;
+		}
+	}
+	return min(bucket_top(b < HISTOGRAM_BUCKETS ? b : HISTOGRAM_BUCKETS - 1), LOAD(h->max));
+}
+
+
+struct histogram_ histogram = {
+	histogram_init,
+	histogram_record,
+	histogram_count,
+	histogram_mean,
+	histogram_highest,
+	histogram_percentile
+};
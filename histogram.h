@@ -0,0 +1,61 @@
+/**
+ * #Histogram
+ *
+ * Log-linear histogram of uint64 values, HDR style: values below 16 are
+ * counted exactly, larger ones in 8 sub-buckets per power of two, so any
+ * reported percentile is within 12.5% of the recorded value.
+ *
+ * There is one writer, record never locks, and any thread may read a
+ * histogram while it is written. Readers see a consistent enough picture
+ * for monitoring, not an atomic snapshot.
+ *
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define HISTOGRAM_BUCKETS	496
+
+typedef struct _histogram {
+	uint64_t count;
+	uint64_t sum;
+	uint64_t max;
+	uint64_t buckets[HISTOGRAM_BUCKETS];
+} histogram_t;
+
+extern struct histogram_ {
+	/** Reset every count, writer thread only. */
+	void (*init)(histogram_t *h);
+
+	/** Record a value, writer thread only. */
+	void (*record)(histogram_t *h, uint64_t v);
+
+	/** Return the number of recorded values. */
+	uint64_t (*count)(const histogram_t *h);
+
+	/** Return the mean of the recorded values, 0 if none. */
+	uint64_t (*mean)(const histogram_t *h);
+
+	/** Return the largest recorded value. */
+	uint64_t (*highest)(const histogram_t *h);
+
+	/**
+	 * Return the value at percentile p (0 to 100).
+	 *
+	 * The upper bound of the bucket holding the value is returned, capped
+	 * by the largest recorded value. Return 0 if nothing was recorded.
+	 */
+	uint64_t (*percentile)(const histogram_t *h, double p);
+} histogram;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // HISTOGRAM_H
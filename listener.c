@@ -10,6 +10,10 @@
 #include <sys/types.h>
 #include <errno.h>
 
+#ifdef __linux__
+#include <linux/filter.h>
+#endif
+
 struct _listener {
 	event_t ev;
 	eventloop_t *loop;
@@ -18,14 +22,25 @@ struct _listener {
 	int listening;
 	int backlog;
 	int flags;
+	int busy_poll;
 	listener_accept_pt acceptor;
 	char name[64];
 };
 
-static void _accept_dispatch(eventloop_t *loop, event_t *ev) {
-	(void)loop;
+static void busy_poll(int fd, int usec) {
+#ifdef SO_BUSY_POLL
+	(void)setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof usec);
+#endif
+#ifdef SO_PREFER_BUSY_POLL
+	int on = 1;
+	(void)setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof on);
+#endif
+	(void)fd;
+	(void)usec;
+}
+
+static int accept_one(listener_t *lstn) {
 	int fd;
-	listener_t *lstn = container_of(ev, listener_t, ev);
 	sockaddr_t addr;
 	socklen_t alen = sizeof(addr.sa);
 	socket_t *sock;
@@ -39,15 +54,14 @@ static void _accept_dispatch(eventloop_t *loop, event_t *ev) {
 	if (lstn->flags & SOCK_NONBLOCK) {
 		a4flags |= SOCK_NONBLOCK;
 	}
-	fd = accept4(ev->fd, &addr.sa.sa, &alen, a4flags);
+	fd = accept4(lstn->ev.fd, &addr.sa.sa, &alen, a4flags);
 
 #else
-	fd = accept(ev->fd, &addr.sa.sa, &alen);
+	fd = accept(lstn->ev.fd, &addr.sa.sa, &alen);
 #endif
 
 	if (fd == -1) {
-		logger.warn("accept error: %s\n", strerror(errno));
-		return;
+		return -1;
 	}
 
 #ifndef HAVE_ACCEPT4
@@ -59,14 +73,48 @@ static void _accept_dispatch(eventloop_t *loop, event_t *ev) {
 	}
 #endif
 
+	if (lstn->busy_poll) {
+		busy_poll(fd, lstn->busy_poll);
+	}
+
 	addr.family = addr.sa.sa.sa_family;
 	sock = socket_.new(fd, &lstn->addr, &addr);
 	if (!sock) {
 		close(fd);
-		return;
+		return 0;
 	}
 
 	lstn->acceptor(lstn, sock);
+	return 0;
+}
+
+/* The listener is edge triggered, so accept until EAGAIN or the loop's
+ * accept budget is spent, then queue it to resume after the others. On a
+ * shared loop it is oneshot instead, so one thread accepts at a time and
+ * re-arms it once done. */
+static void _accept_dispatch(eventloop_t *loop, event_t *ev) {
+	listener_t *lstn = container_of(ev, listener_t, ev);
+	int i;
+
+	for (i = 0; i < loop->accept_budget; i++) {
+		if (!lstn->enabled) {
+			return;
+		}
+		if (accept_one(lstn)) {
+			if (errno == EINTR || errno == ECONNABORTED) {
+				continue;
+			}
+			if (errno != EAGAIN) {
+				logger.warn("accept error: %s\n", strerror(errno));
+			}
+			break;
+		}
+	}
+	if (loop->shared) {
+		eventloop.apply(loop, ev);
+	} else if (i == loop->accept_budget) {
+		eventloop.ready(loop, ev, EVMASK_READ);
+	}
 }
 
 
@@ -111,12 +159,14 @@ static listener_t *listener_new(const char *name, eventloop_t *loop, listener_ac
 	lstn->acceptor = acceptor;
 	lstn->flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
 	snprintf(lstn->name, sizeof lstn->name, "%s", name);
+	lstn->ev.label = lstn->name;
 	listener_set_backlog(lstn, 0);
 
 	return lstn;
 }
 
 static void listener_free(listener_t *lstn) {
+	eventloop.detach(lstn->loop, &lstn->ev);
 	alloc(lstn, 0);
 }
 
@@ -182,6 +232,35 @@ static int listener_enable(listener_t *lstn, int enable) {
 	return 0;
 }
 
+static int listener_steer(listener_t *lstn, int cpu, int groups) {
+#ifdef SO_INCOMING_CPU
+	if (setsockopt(lstn->ev.fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof cpu)) {
+		return -1;
+	}
+#else
+	(void)cpu;
+#endif
+	if (groups <= 0) {
+		return 0;
+	}
+#if defined(SO_ATTACH_REUSEPORT_CBPF) && defined(SKF_AD_CPU)
+	struct sock_filter code[] = {
+		{ BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_AD_OFF + SKF_AD_CPU },
+		{ BPF_ALU | BPF_MOD | BPF_K, 0, 0, groups },
+		{ BPF_RET | BPF_A, 0, 0, 0 },
+	};
+	struct sock_fprog prog = { sizeof code / sizeof code[0], code };
+	return setsockopt(lstn->ev.fd, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof prog);
+#else
+	errno = ENOTSUP;
+	return -1;
+#endif
+}
+
+static void listener_set_busy_poll(listener_t *lstn, int usec) {
+	lstn->busy_poll = usec > 0 ? usec : 0;
+}
+
 struct listener_ listener = {
 	listener_new,
 	listener_free,
@@ -189,5 +268,7 @@ struct listener_ listener = {
 	listener_fd,
 	listener_loop,
 	listener_set_backlog,
-	listener_enable
+	listener_enable,
+	listener_steer,
+	listener_set_busy_poll
 };
@@ -16,7 +16,7 @@ extern struct listener_ {
 	/** Create a new listener with specifity name. */
 	listener_t *(*new)(const char *name, eventloop_t *loop, listener_accept_pt acceptor);
 
-	/** Free the listener. */
+	/** Free the listener, on it's loop thread or once the loop stopped. */
 	void (*free)(listener_t *lstn);
 
 	/**
@@ -62,6 +62,23 @@ extern struct listener_ {
 	 */
 	int (*enable)(listener_t *listener, int enable);
 
+	/**
+	 * Steer connections of a SO_REUSEPORT group by receiving cpu
+	 *
+	 * Sets SO_INCOMING_CPU to `cpu`. If `groups` > 0, also attaches a
+	 * reuseport CBPF program to the group, selecting the socket at index
+	 * (cpu % groups) in bind order. Must be called after bind.
+	 */
+	int (*steer)(listener_t *listener, int cpu, int groups);
+
+	/**
+	 * Set SO_BUSY_POLL to usec on accepted sockets, 0 disable.
+	 *
+	 * Also sets SO_PREFER_BUSY_POLL where available. Values above the
+	 * net.core.busy_read sysctl need CAP_NET_ADMIN, failures are ignored.
+	 */
+	void (*set_busy_poll)(listener_t *listener, int usec);
+
 } listener;
 
 #ifdef __cplusplus
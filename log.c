@@ -1,5 +1,8 @@
 #include "_.h"
 #include "log.h"
+#include "timer.h"
+
+#include <inttypes.h>
 
 static uint8_t log_level = LOG_ERROR;
 static const char *log_labels[] = {
@@ -20,13 +23,15 @@ static uint8_t log_getlevel(void) {
 
 static void logv(uint8_t level, const char *fmt, va_list ap) {
 	va_list copy;
+	int64_t ms;
 
 	if (level < log_level) {
 		return;
 	}
 
+	ms = timer.coarse();
 	va_copy(copy, ap);
-	fprintf(stderr, "[%s] ", log_labels[level]);
+	fprintf(stderr, "%" PRId64 ".%03d [%s] ", ms / 1000, (int)(ms % 1000), log_labels[level]);
 	vfprintf(stderr, fmt, copy);
 	va_end(copy);
 }
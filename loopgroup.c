@@ -0,0 +1,520 @@
+#include "_.h"
+#include "loopgroup.h"
+#include "lock.h"
+#include "log.h"
+#include "timer.h"
+
+#include <sys/eventfd.h>
+
+struct _member {
+	struct _loopgroup *group;
+	eventloop_t *loop;
+	thread_t *thrd;
+	listener_t *lstn;
+	event_t hev;
+	mpsc_t handoffs;
+	int signalled;
+	int inflight;
+	int64_t signal_at;
+	int64_t latency;
+	int *cpus;
+	int ncpus;
+	int failed;	/* errno of a loop that could not be created. */
+	timeout_t rto;
+	int64_t busy_mark;
+	int64_t load;	/* accounted cpu of the last rebalance period. */
+};
+
+struct _loopgroup {
+	int n;
+	int started;
+	int policy;
+	unsigned rr;
+	int pin;
+	const struct eventpoll_ *backend;
+	uint32_t rebalance;
+	struct _member *members;
+	eventloop_t *shared;
+	char name[48];
+};
+
+
+static int member_init(struct _member *m);
+
+/* Loops of a group are created by their own thread, so the memory of a
+ * pinned loop is first touched on it's node. */
+static void *_loop_run(void *ud) {
+	struct _member *m = ud;
+	if (!m->group->shared && member_init(m)) {
+		m->failed = errno ? errno : ENOMEM;
+		__sync_add_and_fetch(&m->group->started, 1);
+		return 0;
+	}
+	__sync_add_and_fetch(&m->group->started, 1);
+	eventloop.loop(m->loop);
+	return 0;
+}
+
+
+static void _handoff_dispatch(eventloop_t *loop, event_t *ev) {
+	(void)loop;
+	struct _member *m = ev->ud;
+	mpscnode_t *node;
+	uint64_t on;
+
+	if (read(ev->fd, &on, sizeof on) != sizeof on && errno != EAGAIN) {
+		logger.warn("handoff read error: %s\n", strerror(errno));
+	}
+	m->latency = (m->latency * 7 + (timer.usec() - m->signal_at)) / 8;
+	(void)SYNC_SET(m->signalled, 0);
+	while ((node = mpsc.pop(&m->handoffs))) {
+		socket_t *sock = container_of(node, socket_t, ev.node);
+		__sync_sub_and_fetch(&m->inflight, 1);
+		if (m->group->pin) {
+			buffer.rehome(stream.buffer(sock->istm));
+			buffer.rehome(stream.buffer(sock->ostm));
+		}
+		if (socket_.enable(sock, 1)) {
+			sock->cb(sock, EVMASK_ERROR, sock->ev.ud);
+		}
+	}
+}
+
+
+static void loopgroup_exit(loopgroup_t *group) {
+	int i;
+	for (i = 0; i < group->n; i++) {
+		if (group->members[i].loop) {
+			eventloop.exit(group->members[i].loop);
+		}
+	}
+}
+
+
+static void loopgroup_free(loopgroup_t *group) {
+	int i;
+
+	loopgroup_exit(group);
+	for (i = 0; i < group->n; i++) {
+		if (group->members[i].thrd) {
+			thread.join(group->members[i].thrd, 0);
+		}
+	}
+	for (i = 0; i < group->n; i++) {
+		struct _member *m = &group->members[i];
+		if (m->lstn) {
+			close(listener.fd(m->lstn));
+			listener.free(m->lstn);
+		}
+		if (m->hev.fd != -1) {
+			close(m->hev.fd);
+		}
+		if (m->loop && !group->shared) {
+			eventloop.free(m->loop);
+		}
+		alloc(m->cpus, 0);
+	}
+	if (group->shared) {
+		eventloop.free(group->shared);
+	}
+	alloc(group->members, 0);
+	alloc(group, 0);
+}
+
+
+static void _rebalance(timeout_t *to);
+
+static loopgroup_t *group_new(const char *name, int n) {
+	loopgroup_t *group;
+	int i;
+
+	if (n <= 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+		if (n <= 0) {
+			n = 1;
+		}
+	}
+	group = alloc(0, sizeof *group);
+	if (!group) {
+		return 0;
+	}
+	group->members = alloc(0, n * sizeof *group->members);
+	if (!group->members) {
+		alloc(group, 0);
+		return 0;
+	}
+	group->n = n;
+	for (i = 0; i < n; i++) {
+		group->members[i].group = group;
+		group->members[i].hev.fd = -1;
+		timewheel.init(&group->members[i].rto, _rebalance, &group->members[i]);
+	}
+	snprintf(group->name, sizeof group->name, "%s", name);
+	return group;
+}
+
+
+static int group_start(loopgroup_t *group) {
+	char tname[64];
+	thread_attr_t attr;
+	int i;
+
+	for (i = 0; i < group->n; i++) {
+		struct _member *m = &group->members[i];
+		snprintf(tname, sizeof tname, "%s-%d", group->name, i);
+		attr.name = tname;
+		attr.cpus = m->cpus;
+		attr.ncpus = m->ncpus;
+		m->thrd = thread.new_attr(&attr, _loop_run, m);
+		if (!m->thrd) {
+			while (SYNC_GET(group->started) != i) {}
+			return -1;
+		}
+	}
+	while (SYNC_GET(group->started) != group->n) {}
+	for (i = 0; i < group->n; i++) {
+		if (group->members[i].failed) {
+			errno = group->members[i].failed;
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+static int member_init(struct _member *m) {
+	m->loop = eventloop.new_backend(m->group->backend);
+	if (!m->loop) {
+		return -1;
+	}
+	if (m->group->pin) {
+		m->loop->node = thread.node(m->cpus[0]);
+	}
+	mpsc.init(&m->handoffs);
+	event.init(&m->hev, eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK), EVMASK_READ, _handoff_dispatch, m);
+	m->hev.label = "handoff";
+	if (m->hev.fd == -1 || eventloop.apply(m->loop, &m->hev)) {
+		return -1;
+	}
+	return 0;
+}
+
+
+/* Fill cpus grouped by node, start[k] is the first cpu of the k-th
+ * node and start[nnodes] the number of cpus. Return nnodes. */
+static int topology(int **cpus, int **start) {
+	int nconf = max(sysconf(_SC_NPROCESSORS_CONF), 1);
+	int node, cnt, n = 0, nnodes = 0;
+
+	*cpus = alloc(0, nconf * sizeof **cpus);
+	*start = alloc(0, (nconf + 1) * sizeof **start);
+	if (!*cpus || !*start) {
+		alloc(*cpus, 0);
+		alloc(*start, 0);
+		return -1;
+	}
+	for (node = 0; node < nconf && n < nconf; node++) {
+		cnt = thread.node_cpus(node, *cpus + n, nconf - n);
+		if (cnt > 0) {
+			(*start)[nnodes++] = n;
+			n += min(cnt, nconf - n);
+		}
+	}
+	(*start)[nnodes] = n;
+	return nnodes;
+}
+
+
+static int pin_members(loopgroup_t *group, int pin, const int *cpus, const int *start, int nnodes) {
+	int i;
+
+	for (i = 0; i < group->n; i++) {
+		struct _member *m = &group->members[i];
+		const int *from = cpus + i % start[nnodes];
+		m->ncpus = 1;
+		if (pin == LOOPGROUP_PIN_NODE) {
+			from = cpus + start[i % nnodes];
+			m->ncpus = start[i % nnodes + 1] - start[i % nnodes];
+		}
+		m->cpus = alloc(0, m->ncpus * sizeof *m->cpus);
+		if (!m->cpus) {
+			return -1;
+		}
+		memcpy(m->cpus, from, m->ncpus * sizeof *m->cpus);
+	}
+	return 0;
+}
+
+
+static loopgroup_t *loopgroup_new_pinned(const char *name, int n, const struct eventpoll_ *backend, int pin) {
+	loopgroup_t *group;
+	int *cpus = 0, *start = 0, nnodes = 0;
+
+	if (pin != LOOPGROUP_PIN_NONE) {
+		nnodes = topology(&cpus, &start);
+		if (nnodes <= 0) {
+			return 0;
+		}
+		if (n <= 0) {
+			n = pin == LOOPGROUP_PIN_NODE ? nnodes : start[nnodes];
+		}
+	}
+	group = group_new(name, n);
+	if (group && pin != LOOPGROUP_PIN_NONE && pin_members(group, pin, cpus, start, nnodes)) {
+		loopgroup_free(group);
+		group = 0;
+	}
+	alloc(cpus, 0);
+	alloc(start, 0);
+	if (!group) {
+		return 0;
+	}
+	group->pin = pin;
+	group->backend = backend ? backend : &eventpoll;
+	if (group_start(group)) {
+		logger.err("loopgroup %s: %s\n", group->name, strerror(errno));
+		loopgroup_free(group);
+		return 0;
+	}
+	return group;
+}
+
+
+static loopgroup_t *loopgroup_new(const char *name, int n, const struct eventpoll_ *backend) {
+	return loopgroup_new_pinned(name, n, backend, LOOPGROUP_PIN_NONE);
+}
+
+
+static loopgroup_t *loopgroup_new_shared(const char *name, int n) {
+	loopgroup_t *group = group_new(name, n);
+	int i;
+
+	if (!group) {
+		return 0;
+	}
+	group->shared = eventloop.new_backend(&eventpoll_shared);
+	if (!group->shared) {
+		goto err;
+	}
+	for (i = 0; i < group->n; i++) {
+		group->members[i].loop = group->shared;
+	}
+	if (group_start(group)) {
+		goto err;
+	}
+	return group;
+
+err:
+	logger.err("loopgroup %s: %s\n", group->name, strerror(errno));
+	loopgroup_free(group);
+	return 0;
+}
+
+
+static int loopgroup_size(loopgroup_t *group) {
+	return group->n;
+}
+
+
+static eventloop_t *loopgroup_loop(loopgroup_t *group, int i) {
+	return group->members[i].loop;
+}
+
+
+static int loopgroup_listen(loopgroup_t *group, const sockaddr_t *addr, listener_accept_pt acceptor) {
+	char name[64];
+	int i;
+
+	if (group->shared) {
+		struct _member *m = &group->members[0];
+		m->lstn = listener.new(group->name, group->shared, acceptor);
+		if (!m->lstn || listener.bind(m->lstn, addr)) {
+			return -1;
+		}
+		return listener.enable(m->lstn, 1);
+	}
+	for (i = 0; i < group->n; i++) {
+		struct _member *m = &group->members[i];
+		snprintf(name, sizeof name, "%s-%d", group->name, i);
+		m->lstn = listener.new(name, m->loop, acceptor);
+		if (!m->lstn || listener.bind(m->lstn, addr)) {
+			return -1;
+		}
+	}
+	for (i = 0; i < group->n; i++) {
+		if (listener.enable(group->members[i].lstn, 1)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+static int loopgroup_steer(loopgroup_t *group) {
+	int i;
+	if (group->shared) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	for (i = 0; i < group->n; i++) {
+		if (!group->members[i].lstn) {
+			errno = EINVAL;
+			return -1;
+		}
+		if (listener.steer(group->members[i].lstn, i, i == 0 ? group->n : 0)) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+static void loopgroup_set_policy(loopgroup_t *group, int policy) {
+	group->policy = policy;
+}
+
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+/* Each loop publishes the cpu its sockets used in the last period, only
+ * the busiest one acts: it moves its hottest socket to the idlest loop
+ * when that narrows the gap, so a single hot socket is never bounced. */
+static void _rebalance(timeout_t *to) {
+	struct _member *m = to->ud, *cold = 0, *hot = 0;
+	loopgroup_t *group = m->group;
+	eventloop_t *loop = m->loop;
+	int64_t load = loop->busy - m->busy_mark;
+	int i;
+
+	m->busy_mark = loop->busy;
+	__atomic_store_n(&m->load, load, __ATOMIC_RELAXED);
+	for (i = 0; i < group->n; i++) {
+		struct _member *o = &group->members[i];
+		if (!cold || LOAD(o->load) < LOAD(cold->load)) {
+			cold = o;
+		}
+		if (!hot || LOAD(o->load) > LOAD(hot->load)) {
+			hot = o;
+		}
+	}
+	if (hot == m && cold != m && loop->hot
+			&& load * 10 >= (int64_t)group->rebalance * 1000
+			&& loop->hot_cpu < load - LOAD(cold->load)) {
+		socket_t *sock = container_of(loop->hot, socket_t, ev);
+		int64_t cpu = loop->hot_cpu;
+		if (sock->enabled && !socket_.migrate(sock, cold->loop)) {
+			__atomic_store_n(&m->load, load - cpu, __ATOMIC_RELAXED);
+			__sync_add_and_fetch(&cold->load, cpu);
+		}
+	}
+	loop->epoch++;
+	loop->hot = 0;
+	loop->hot_cpu = 0;
+	if (group->rebalance) {
+		eventloop.timeout(loop, &m->rto, group->rebalance);
+	}
+}
+
+
+static void _rebalance_start(eventloop_t *loop, void *ud) {
+	struct _member *m = ud;
+	uint32_t ms = m->group->rebalance;
+
+	loop->accounting = ms != 0;
+	m->busy_mark = loop->busy;
+	if (ms) {
+		eventloop.timeout(loop, &m->rto, ms);
+	} else {
+		eventloop.cancel(loop, &m->rto);
+	}
+}
+
+
+static int loopgroup_rebalance(loopgroup_t *group, uint32_t ms) {
+	int i;
+
+	if (group->shared) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	group->rebalance = ms;
+	for (i = 0; i < group->n; i++) {
+		if (eventloop.post(group->members[i].loop, _rebalance_start, &group->members[i])) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+
+static int member_load(struct _member *m) {
+	return __atomic_load_n(&m->loop->nsocks, __ATOMIC_RELAXED)
+		+ __atomic_load_n(&m->inflight, __ATOMIC_RELAXED);
+}
+
+
+static struct _member *pick(loopgroup_t *group) {
+	struct _member *best;
+	int i;
+
+	best = &group->members[__sync_fetch_and_add(&group->rr, 1) % group->n];
+	if (group->policy == LOOPGROUP_LEASTCONN) {
+		for (i = 0; i < group->n; i++) {
+			struct _member *m = &group->members[i];
+			if (member_load(m) < member_load(best)) {
+				best = m;
+			}
+		}
+	} else if (group->policy == LOOPGROUP_LATENCY) {
+		for (i = 0; i < group->n; i++) {
+			struct _member *m = &group->members[i];
+			int64_t lm = __atomic_load_n(&m->latency, __ATOMIC_RELAXED);
+			int64_t lb = __atomic_load_n(&best->latency, __ATOMIC_RELAXED);
+			if (lm < lb || (lm == lb && member_load(m) < member_load(best))) {
+				best = m;
+			}
+		}
+	}
+	return best;
+}
+
+
+static int loopgroup_handoff(loopgroup_t *group, socket_t *sock) {
+	struct _member *m;
+	uint64_t on = 1;
+
+	if (group->shared) {
+		sock->loop = group->shared;
+		return socket_.enable(sock, 1);
+	}
+	m = pick(group);
+	sock->loop = m->loop;
+	__sync_add_and_fetch(&m->inflight, 1);
+	mpsc.push(&m->handoffs, &sock->ev.node);
+	/* the socket is queued either way, a failed signal is left to the
+	 * next handoff to retry. */
+	if (!SYNC_SET(m->signalled, 1)) {
+		m->signal_at = timer.usec();
+		if (write(m->hev.fd, &on, sizeof on) != sizeof on) {
+			(void)SYNC_SET(m->signalled, 0);
+			logger.warn("handoff write error: %s\n", strerror(errno));
+		}
+	}
+	return 0;
+}
+
+
+struct loopgroup_ loopgroup = {
+	loopgroup_new,
+	loopgroup_new_pinned,
+	loopgroup_new_shared,
+	loopgroup_free,
+	loopgroup_size,
+	loopgroup_loop,
+	loopgroup_listen,
+	loopgroup_steer,
+	loopgroup_set_policy,
+	loopgroup_handoff,
+	loopgroup_rebalance,
+	loopgroup_exit
+};
@@ -0,0 +1,115 @@
+#ifndef LOOPGROUP_H
+#define LOOPGROUP_H
+
+#include "listener.h"
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define LOOPGROUP_ROUNDROBIN	0
+#define LOOPGROUP_LEASTCONN		1
+#define LOOPGROUP_LATENCY		2
+
+#define LOOPGROUP_PIN_NONE		0
+#define LOOPGROUP_PIN_CPU		1
+#define LOOPGROUP_PIN_NODE		2
+
+struct _loopgroup;
+typedef struct _loopgroup loopgroup_t;
+
+extern struct loopgroup_ {
+	/**
+	 * Create a group of n eventloops, each running on it's own thread.
+	 *
+	 * If n is <= 0, one loop per online cpu is created. If backend is 0
+	 * the default eventpoll is used. Returns once every loop is running.
+	 */
+	loopgroup_t *(*new)(const char *name, int n, const struct eventpoll_ *backend);
+
+	/**
+	 * Create a group of n eventloops with pinned threads.
+	 *
+	 * LOOPGROUP_PIN_CPU pins loop i to the i-th online cpu, cpus ordered
+	 * by NUMA node, LOOPGROUP_PIN_NODE pins loop i to every cpu of the
+	 * i-th node. If n is <= 0 one loop per cpu, or per node, is created.
+	 * Each loop is created by it's own thread and handoff moves the
+	 * socket buffers to memory allocated there, so loop state and socket
+	 * buffers are local to the node of the loop, see loop->node.
+	 */
+	loopgroup_t *(*new_pinned)(const char *name, int n, const struct eventpoll_ *backend, int pin);
+
+	/**
+	 * Create a group of n threads running a single eventpoll_shared loop.
+	 *
+	 * Any idle thread picks up any ready socket, so a few connections with
+	 * heavy requests don't pin one loop while the others sit idle. listen
+	 * binds one listener and handoff enables the socket on the shared
+	 * loop, steer is not supported. See eventloop.new_backend for what a
+	 * shared loop can't do.
+	 */
+	loopgroup_t *(*new_shared)(const char *name, int n);
+
+	/** Stop every loop, join the threads and free the group with it's listeners. */
+	void (*free)(loopgroup_t *group);
+
+	/** Return the number of loops in the group. */
+	int (*size)(loopgroup_t *group);
+
+	/** Return the i-th loop of the group. */
+	eventloop_t *(*loop)(loopgroup_t *group, int i);
+
+	/**
+	 * Listen on addr from every loop.
+	 *
+	 * One listener socket is bound per loop with SO_REUSEPORT, so the kernel
+	 * shards incoming connections and each acceptor runs on the loop
+	 * that owns the listener, see listener.loop().
+	 */
+	int (*listen)(loopgroup_t *group, const sockaddr_t *addr, listener_accept_pt acceptor);
+
+	/**
+	 * Steer connections to the listener of the cpu that received them.
+	 *
+	 * Sets SO_INCOMING_CPU on each listener and attaches a reuseport CBPF
+	 * program selecting listener (cpu % size). Only useful when loop i runs
+	 * on cpu i. Must be called after listen.
+	 */
+	int (*steer)(loopgroup_t *group);
+
+	/** Set the placement policy of handoff, LOOPGROUP_ROUNDROBIN by default. */
+	void (*set_policy)(loopgroup_t *group, int policy);
+
+	/**
+	 * Hand an accepted socket to a loop of the group.
+	 *
+	 * The loop is chosen by the placement policy: round-robin, fewest
+	 * enabled sockets, or lowest recent handoff latency. sock->loop is set
+	 * here and the socket is enabled on the worker thread, so sock->cb and
+	 * the deadlines must be set before. The handoff is lock-free and the
+	 * worker is signalled at most once per drain.
+	 */
+	int (*handoff)(loopgroup_t *group, socket_t *sock);
+
+	/**
+	 * Rebalance connections between the loops every ms, 0 disable.
+	 *
+	 * Enables socket accounting on every loop, which times each socket
+	 * callback. At the end of each period the loop whose sockets used the
+	 * most cpu migrates its hottest socket to the least busy loop, see
+	 * socket_.migrate, unless the move would not narrow the gap or the
+	 * loop was busy for less than a tenth of the period. Not supported by
+	 * shared groups.
+	 */
+	int (*rebalance)(loopgroup_t *group, uint32_t ms);
+
+	/** Ask every loop to exit. */
+	void (*exit)(loopgroup_t *group);
+
+} loopgroup;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // LOOPGROUP_H
@@ -0,0 +1,67 @@
+#include "_.h"
+#include "mpsc.h"
+
+static void mpsc_init(mpsc_t *q) {
+	q->stub.next = 0;
+	q->head = &q->stub;
+	q->tail = &q->stub;
+}
+
+
+static void mpsc_push(mpsc_t *q, mpscnode_t *node) {
+	mpscnode_t *prev;
+	node->next = 0;
+	prev = __atomic_exchange_n(&q->head, node, __ATOMIC_ACQ_REL);
+	__atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+}
+
+
+/* A producer between it's exchange and link leaves the list cut, the
+ * window is two instructions so the consumer spins instead of reporting
+ * empty and stranding the nodes behind it. */
+static mpscnode_t *next_of(mpsc_t *q, mpscnode_t *node) {
+	mpscnode_t *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	while (!next && node != __atomic_load_n(&q->head, __ATOMIC_ACQUIRE)) {
+		next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+	}
+	return next;
+}
+
+
+static mpscnode_t *mpsc_pop(mpsc_t *q) {
+	mpscnode_t *tail = q->tail;
+	mpscnode_t *next = next_of(q, tail);
+
+	if (tail == &q->stub) {
+		if (!next) {
+			return 0;
+		}
+		q->tail = next;
+		tail = next;
+		next = next_of(q, tail);
+	}
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	mpsc_push(q, &q->stub);
+	next = next_of(q, tail);
+	if (next) {
+		q->tail = next;
+		return tail;
+	}
+	return 0;
+}
+
+
+static int mpsc_empty(mpsc_t *q) {
+	return q->tail == &q->stub && !__atomic_load_n(&q->stub.next, __ATOMIC_ACQUIRE);
+}
+
+
+struct mpsc_ mpsc = {
+	mpsc_init,
+	mpsc_push,
+	mpsc_pop,
+	mpsc_empty
+};
@@ -0,0 +1,47 @@
+/**
+ * #MPSC
+ *
+ * Intrusive lock-free multi-producer single-consumer queue.
+ * push is wait-free (one exchange), pop must be called from
+ * one consumer thread only.
+ *
+ */
+
+#ifndef MPSC_H
+#define MPSC_H
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+typedef struct _mpscnode mpscnode_t;
+
+struct _mpscnode {
+	struct _mpscnode *next;
+};
+
+typedef struct _mpsc {
+	mpscnode_t *head;
+	mpscnode_t *tail;
+	mpscnode_t stub;
+} mpsc_t;
+
+extern struct mpsc_ {
+	/** Initialize an empty queue. */
+	void (*init)(mpsc_t *q);
+
+	/** Push a node, safe from any thread. */
+	void (*push)(mpsc_t *q, mpscnode_t *node);
+
+	/** Pop the oldest node, consumer thread only. Return 0 if empty. */
+	mpscnode_t *(*pop)(mpsc_t *q);
+
+	/** Return 1 if the queue looks empty. */
+	int (*empty)(mpsc_t *q);
+} mpsc;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // MPSC_H
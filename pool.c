@@ -0,0 +1,251 @@
+#include "_.h"
+#include "pool.h"
+#include "mpsc.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#endif
+
+#define POOL_CACHE_BYTES	(1 << 20)
+
+#define LOAD(x)		__atomic_load_n(&(x), __ATOMIC_RELAXED)
+#define STORE(x, v)	__atomic_store_n(&(x), (v), __ATOMIC_RELAXED)
+
+typedef struct _pool pool_t;
+
+/* A free block links through the first bytes of it's payload. */
+typedef struct _block {
+	pool_t *owner;		/* 0 for blocks larger than the last class. */
+	size_t size;
+	mpscnode_t node;
+} block_t;
+
+#define BLOCK_HDR	offset_of(block_t, node)
+
+struct _pool {
+	pool_t *next;
+	int dead;			/* the thread exited, the pool waits for adoption. */
+	mpscnode_t *free[POOL_CLASSES];
+	uint32_t count[POOL_CLASSES];
+	mpsc_t remote;		/* blocks freed by other threads. */
+	pool_stats_t st;
+};
+
+#ifdef HAVE___THREAD
+static __thread pool_t *__pool_self;
+#endif
+static pthread_key_t pool_key;
+static pthread_once_t pool_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static pool_t *pools;
+
+
+static int class_of(size_t size) {
+	if (size <= (1 << POOL_MIN_P)) {
+		return 0;
+	}
+	return 64 - __builtin_clzll(size - 1) - POOL_MIN_P;
+}
+
+
+static void cache(pool_t *p, block_t *b) {
+	int cls = class_of(b->size);
+	if (p->count[cls] >= 2 && (p->count[cls] + 1) * b->size > POOL_CACHE_BYTES) {
+		alloc(b, 0);
+		return;
+	}
+	b->node.next = p->free[cls];
+	p->free[cls] = &b->node;
+	p->count[cls]++;
+	STORE(p->st.cached, p->st.cached + b->size);
+}
+
+
+static void drain(pool_t *p) {
+	mpscnode_t *node;
+	while ((node = mpsc.pop(&p->remote))) {
+		cache(p, container_of(node, block_t, node));
+	}
+}
+
+
+static void release(pool_t *p) {
+	mpscnode_t *node;
+	int cls;
+
+	drain(p);
+	for (cls = 0; cls < POOL_CLASSES; cls++) {
+		while ((node = p->free[cls])) {
+			p->free[cls] = node->next;
+			alloc(container_of(node, block_t, node), 0);
+		}
+		p->count[cls] = 0;
+	}
+	STORE(p->st.cached, 0);
+}
+
+
+static void pool_exit(void *ud) {
+	pool_t *p = ud;
+#ifdef HAVE___THREAD
+	__pool_self = 0;
+#endif
+	release(p);
+	pthread_mutex_lock(&pools_lock);
+	p->dead = 1;
+	pthread_mutex_unlock(&pools_lock);
+}
+
+
+static void pool_init_once(void) {
+	pthread_key_create(&pool_key, pool_exit);
+}
+
+
+/* A new thread adopts the pool of an exited one before creating it's own,
+ * so blocks queued to the dead pool are not stranded. */
+static pool_t *current(int create) {
+	pool_t *p = 0;
+#ifdef HAVE___THREAD
+	p = __pool_self;
+	if (p) {
+		return p;
+	}
+#endif
+	pthread_once(&pool_once, pool_init_once);
+	p = pthread_getspecific(pool_key);
+	if (p || !create) {
+		return p;
+	}
+	pthread_mutex_lock(&pools_lock);
+	for (p = pools; p && !p->dead; p = p->next) {}
+	if (p) {
+		p->dead = 0;
+	} else if ((p = alloc(0, sizeof *p))) {
+		mpsc.init(&p->remote);
+		p->next = pools;
+		pools = p;
+	}
+	pthread_mutex_unlock(&pools_lock);
+	if (!p) {
+		return 0;
+	}
+#ifdef HAVE___THREAD
+	__pool_self = p;
+#endif
+	pthread_setspecific(pool_key, p);
+	return p;
+}
+
+
+static void *pool_get(size_t size) {
+	int cls = class_of(size);
+	pool_t *p = 0;
+	block_t *b;
+
+	if (cls < POOL_CLASSES) {
+		p = current(1);
+	}
+	if (!p) {
+		b = alloc(0, BLOCK_HDR + size);
+		if (!b) {
+			errno = ENOMEM;
+			return 0;
+		}
+		b->owner = 0;
+		b->size = size;
+		return &b->node;
+	}
+	if (!p->free[cls] && !mpsc.empty(&p->remote)) {
+		drain(p);
+	}
+	STORE(p->st.gets, p->st.gets + 1);
+	if (p->free[cls]) {
+		b = container_of(p->free[cls], block_t, node);
+		p->free[cls] = b->node.next;
+		p->count[cls]--;
+		STORE(p->st.hits, p->st.hits + 1);
+		STORE(p->st.cached, p->st.cached - b->size);
+		return &b->node;
+	}
+	size = (size_t)1 << (cls + POOL_MIN_P);
+	b = alloc(0, BLOCK_HDR + size);
+	if (!b) {
+		errno = ENOMEM;
+		return 0;
+	}
+	b->owner = p;
+	b->size = size;
+	return &b->node;
+}
+
+
+static void *pool_alloc(size_t size) {
+	void *mem = pool_get(size);
+	if (mem) {
+		memset(mem, 0, size);
+	}
+	return mem;
+}
+
+
+static void pool_put(void *mem) {
+	block_t *b;
+	pool_t *p;
+
+	if (!mem) {
+		return;
+	}
+	b = container_of(mem, block_t, node);
+	if (!b->owner) {
+		alloc(b, 0);
+		return;
+	}
+	p = current(0);
+	if (b->owner == p) {
+		STORE(p->st.puts, p->st.puts + 1);
+		cache(p, b);
+		return;
+	}
+	__atomic_add_fetch(&b->owner->st.remote, 1, __ATOMIC_RELAXED);
+	mpsc.push(&b->owner->remote, &b->node);
+}
+
+
+static size_t pool_size(const void *mem) {
+	return container_of(mem, block_t, node)->size;
+}
+
+
+static void pool_trim(void) {
+	pool_t *p = current(0);
+	if (p) {
+		release(p);
+	}
+}
+
+
+static void pool_stats(pool_stats_t *st) {
+	pool_t *p;
+
+	memset(st, 0, sizeof *st);
+	pthread_mutex_lock(&pools_lock);
+	for (p = pools; p; p = p->next) {
+		st->gets += LOAD(p->st.gets);
+		st->hits += LOAD(p->st.hits);
+		st->puts += LOAD(p->st.puts);
+		st->remote += LOAD(p->st.remote);
+		st->cached += LOAD(p->st.cached);
+	}
+	pthread_mutex_unlock(&pools_lock);
+}
+
+
+struct pool_ pool = {
+	pool_get,
+	pool_alloc,
+	pool_put,
+	pool_size,
+	pool_trim,
+	pool_stats
+};
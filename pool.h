@@ -0,0 +1,60 @@
+/**
+ * #Pool
+ *
+ * Per-thread slab pool of power of two size classes, 64 bytes to 1M.
+ *
+ * Every thread allocates from it's own cache and never locks. A block
+ * freed by its owner goes back to the owner's cache, a block freed by
+ * another thread is queued to the owner and picked up by its next miss,
+ * so objects may be freed on any loop, see socket_.migrate. Larger sizes
+ * go straight to alloc. The pool of an exited thread is adopted by the
+ * next thread, with the blocks still queued to it.
+ *
+ */
+
+#ifndef POOL_H
+#define POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+#define POOL_MIN_P		6
+#define POOL_CLASSES	15
+
+typedef struct _pool_stats {
+	uint64_t gets;		/* blocks handed out. */
+	uint64_t hits;		/* gets served from a cache. */
+	uint64_t puts;		/* blocks freed by their owner. */
+	uint64_t remote;	/* blocks freed by another thread. */
+	uint64_t cached;	/* bytes held by the caches. */
+} pool_stats_t;
+
+extern struct pool_ {
+	/** Return at least size bytes, uninitialized. 0 and ENOMEM on failure. */
+	void *(*get)(size_t size);
+
+	/** Return at least size bytes, zeroed like alloc(0, size). */
+	void *(*alloc)(size_t size);
+
+	/** Release a block of get or alloc, from any thread. */
+	void (*put)(void *mem);
+
+	/** Return the usable size of a block, the size class it came from. */
+	size_t (*size)(const void *mem);
+
+	/** Free every block cached by the calling thread. */
+	void (*trim)(void);
+
+	/** Sum the counters of every pool, a monitoring snapshot. */
+	void (*stats)(pool_stats_t *st);
+} pool;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // POOL_H
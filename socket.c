@@ -1,57 +1,422 @@
 #include "_.h"
 #include "socket.h"
 #include "timer.h"
+#include "pool.h"
 
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <stdint.h>
 
+#define SOCK_IOV_MAX	8
+
+/* I/O state of a socket on a backend doing it's own, kept apart so the
+ * sockets of a polling backend stay in their pool size class. */
+struct _sockring {
+	eventio_t rio, wio;
+	int reading, writing;	/* rio and wio are in flight. */
+	struct iovec wiov[SOCK_IOV_MAX];
+};
+
+static void write_pending(socket_t *sock);
+
+
+static int ring_write(socket_t *sock) {
+	struct _sockring *r = sock->ring;
+	eventloop_t *loop = sock->loop;
+	int n;
+
+	if (r->writing || sock->moving || sock->freed) {
+		return 0;
+	}
+	n = buffer.rvec(stream.buffer(sock->ostm), r->wiov, SOCK_IOV_MAX);
+	if (n == 0) {
+		return 0;
+	}
+	if (loop->backend->writev(loop->poll, &r->wio, r->wiov, n)) {
+		return -1;
+	}
+	r->writing = 1;
+	write_pending(sock);
+	return 0;
+}
 
 static int try_write(socket_t *sock) {
-	return stream.flush(sock->ostm);
+	uint32_t avail;
+	int ret;
+
+	if (sock->ring) {
+		return ring_write(sock);
+	}
+	avail = buffer.avail(stream.buffer(sock->ostm));
+	ret = stream.flush(sock->ostm);
+	sock->wbytes += avail - buffer.avail(stream.buffer(sock->ostm));
+	if (ret && stream.err(sock->ostm) != EAGAIN) {
+		return -1;
+	}
+	return 0;
 }
 
+/* The fd is edge triggered, so read until EAGAIN or the loop's read
+ * budget is spent, then queue the socket to resume after the others. */
 static int try_read(socket_t *sock) {
-	int ret = stream.fill(sock->istm, 0);
-	if (ret != 0) {
-		if (stream.err(sock->istm) != EAGAIN) {
+	uint32_t n, total = 0;
+
+	if (sock->ring) {
+		return 0;
+	}
+	while (total < (uint32_t)sock->loop->read_budget) {
+		n = 0;
+		if (stream.fill(sock->istm, &n)) {
+			if (stream.err(sock->istm) == EAGAIN) {
+				return 0;
+			}
+			if (total) {
+				/* deliver the data now and the error on the next pass. */
+				eventloop.ready(sock->loop, &sock->ev, EVMASK_READ);
+				return 0;
+			}
 			return -1;
 		}
-		return 0;
+		total += n;
+		sock->rbytes += n;
 	}
+	eventloop.ready(sock->loop, &sock->ev, EVMASK_READ);
 	return 0;
 }
 
-static void _sock_dispatch(eventloop_t *loop, event_t *ev) {
-	(void)loop;
-	socket_t *sock = container_of(ev, socket_t, ev);
+/* The write deadline only counts while output is queued, an idle socket
+ * keeps no timer for it. */
+static int64_t socket_deadline(socket_t *sock) {
+	int64_t deadline = INT64_MAX;
+
+	if (sock->timeout) {
+		deadline = max(sock->ractive, sock->wactive) + sock->timeout;
+	}
+	if (sock->rtimeout) {
+		deadline = min(deadline, sock->ractive + sock->rtimeout);
+	}
+	if (sock->wtimeout && buffer.avail(stream.buffer(sock->ostm))) {
+		deadline = min(deadline, sock->wactive + sock->wtimeout);
+	}
+	return deadline;
+}
+
+static void socket_arm(socket_t *sock, int64_t now) {
+	int64_t deadline;
+	if (sock->loop->shared) {
+		return;
+	}
+	deadline = socket_deadline(sock);
+	if (deadline == INT64_MAX) {
+		eventloop.cancel(sock->loop, &sock->to);
+		return;
+	}
+	eventloop.timeout(sock->loop, &sock->to, deadline > now ? deadline - now : 0);
+}
+
+/* I/O does not touch the timer, it only stamps ractive/wactive and
+ * the deadline is recomputed lazily when the timer fires. */
+static void _sock_timeout(timeout_t *to) {
+	socket_t *sock = to->ud;
+	int64_t now = eventloop.now(sock->loop);
+
+	if (socket_deadline(sock) > now) {
+		socket_arm(sock, now);
+		return;
+	}
+	sock->ractive = sock->wactive = now;
+	socket_arm(sock, now);
+	sock->cb(sock, EVMASK_TIME, sock->ev.ud);
+}
+
+/* Output was left queued, the write deadline starts now. The timer is
+ * only moved up when it would fire after it. */
+static void write_pending(socket_t *sock) {
+	int64_t now;
+
+	if (!sock->wtimeout || sock->loop->shared) {
+		return;
+	}
+	now = eventloop.now(sock->loop);
+	sock->wactive = now;
+	if (!timewheel.pending(&sock->to) || sock->to.expire > (uint64_t)(now + sock->wtimeout)) {
+		socket_arm(sock, now);
+	}
+}
+
+/* Write interest is only held while the output stream has unflushed
+ * bytes, so the common short response costs no epoll_ctl. */
+static void socket_interest(socket_t *sock) {
+	int mask = EVMASK_READ;
+	if (sock->ring) {
+		return;
+	}
+	if (buffer.avail(stream.buffer(sock->ostm))) {
+		mask |= EVMASK_WRITE;
+	}
+	if (sock->enabled && mask != sock->ev.mask) {
+		if (mask & ~sock->ev.mask & EVMASK_WRITE) {
+			write_pending(sock);
+		}
+		sock->ev.mask = mask;
+		if (!sock->dispatching) {
+			eventloop.apply(sock->loop, &sock->ev);
+		}
+	}
+}
+
+static void sock_dispatch(socket_t *sock, int why) {
 	stream.set_mask(sock->istm, 0);
 
-	if ((ev->mask & (EVMASK_WRITE | EVMASK_ERROR)) == EVMASK_WRITE) {
-		if (try_write(sock)) {
-			ev->mask |= EVMASK_ERROR;
+	/* the deferred flush goes first, the callback may free the socket. */
+	if (why & (EVMASK_FLUSH | EVMASK_WRITE)) {
+		if (!(why & EVMASK_ERROR)) {
+			if (try_write(sock)) {
+				why |= EVMASK_ERROR;
+			} else {
+				sock->wactive = eventloop.now(sock->loop);
+			}
+		}
+		socket_interest(sock);
+		why &= ~EVMASK_FLUSH;
+		if (!why) {
+			return;
 		}
 	}
-	if ((ev->mask & (EVMASK_READ | EVMASK_ERROR)) == EVMASK_READ) {
+	if ((why & (EVMASK_READ | EVMASK_ERROR)) == EVMASK_READ) {
 		if (try_read(sock)) {
-			ev->mask |= EVMASK_ERROR;
+			why |= EVMASK_ERROR;
+		} else {
+			sock->ractive = eventloop.now(sock->loop);
+		}
+	}
+
+	sock->cb(sock, why, sock->ev.ud);
+}
+
+static void socket_free(socket_t *sock);
+static int socket_migrate(socket_t *sock, eventloop_t *to);
+
+/* Charge the callback time to the socket and the loop, the hottest
+ * socket of the epoch is the one loopgroup.rebalance moves. */
+static void account(eventloop_t *loop, socket_t *sock, int64_t cpu) {
+	if (sock->epoch != loop->epoch) {
+		sock->epoch = loop->epoch;
+		sock->wcpu = 0;
+	}
+	sock->cpu += cpu;
+	sock->wcpu += cpu;
+	loop->busy += cpu;
+	if (sock->wcpu > loop->hot_cpu) {
+		loop->hot = &sock->ev;
+		loop->hot_cpu = sock->wcpu;
+	}
+}
+
+/* Free and migrate wait for the callback to return, so does applying
+ * the interest the callback changed. On a shared loop the event stays
+ * disarmed while this thread owns it, it is re-armed after the callback
+ * unless the socket went away. */
+static void _sock_dispatch(eventloop_t *loop, event_t *ev) {
+	socket_t *sock = container_of(ev, socket_t, ev);
+	eventloop_t *to;
+	int64_t start = 0;
+	int mask = ev->mask;
+
+	if (sock->loop != loop) {
+		/* migrated by an earlier callback of the same poll. */
+		return;
+	}
+	if (loop->accounting) {
+		start = timer.usec();
+	}
+	sock->dispatching = 1;
+	sock_dispatch(sock, ev->fired);
+	sock->dispatching = 0;
+	if (sock->freed) {
+		socket_free(sock);
+		return;
+	}
+	/* the ring also writes what a callback flushed on the held stream. */
+	if (sock->ring && ring_write(sock)) {
+		eventloop.ready(loop, ev, EVMASK_ERROR);
+	}
+	/* Once the callback consumed all input the buffer shrinks back to the
+	 * size of the recent traffic, idle connections hold little memory. */
+	if (!buffer.avail(stream.buffer(sock->istm))) {
+		buffer.trim(stream.buffer(sock->istm));
+	}
+	if (loop->accounting) {
+		account(loop, sock, timer.usec() - start);
+	}
+	if (sock->moving) {
+		to = sock->moving;
+		sock->moving = 0;
+		/* stays on this loop when the task ring of the target is full. */
+		socket_migrate(sock, to);
+	} else if (sock->enabled && (loop->shared || ev->mask != mask)) {
+		eventloop.apply(loop, ev);
+	}
+}
+
+static int ring_live(socket_t *sock) {
+	return sock->enabled && !sock->moving && !sock->freed;
+}
+
+static int ring_busy(socket_t *sock) {
+	return sock->ring && (sock->ring->reading || sock->ring->writing);
+}
+
+static void ring_cancel(socket_t *sock) {
+	struct _sockring *r = sock->ring;
+	eventloop_t *loop = sock->loop;
+
+	if (r->reading) {
+		loop->backend->cancel(loop->poll, &r->rio);
+	}
+	if (r->writing) {
+		loop->backend->cancel(loop->poll, &r->wio);
+	}
+	loop->backend->submit(loop->poll);
+}
+
+/* Ring I/O completes on the loop it was queued on, a free or a move
+ * asked for meanwhile waits for the last completion. */
+static void ring_settle(socket_t *sock) {
+	eventloop_t *to;
+
+	if (ring_busy(sock)) {
+		return;
+	}
+	if (sock->freed) {
+		socket_free(sock);
+	} else if (sock->moving) {
+		to = sock->moving;
+		sock->moving = 0;
+		socket_migrate(sock, to);
+	}
+}
+
+/* Arrivals are copied out of the ring's buffer and the callback runs
+ * from the ready list, once for all arrivals of a poll. */
+static void _sock_recv(eventio_t *io) {
+	socket_t *sock = io->ud;
+	struct _sockring *r = sock->ring;
+	eventloop_t *loop = sock->loop;
+	int live = ring_live(sock);
+
+	if (!io->more) {
+		r->reading = 0;
+	}
+	if (io->res > 0) {
+		if (buffer.write(stream.buffer(sock->istm), io->data, io->res) != (uint32_t)io->res) {
+			io->res = -ENOMEM;
+		} else {
+			sock->rbytes += io->res;
+			sock->ractive = eventloop.now(loop);
+			if (live) {
+				eventloop.ready(loop, &sock->ev, EVMASK_READ);
+			}
 		}
 	}
+	if (io->res <= 0 && io->res != -ECANCELED && live) {
+		eventloop.ready(loop, &sock->ev, EVMASK_ERROR);
+	}
+	/* a recv cancelled by a disable is armed again if enabled since. */
+	if (!r->reading && live && (io->res > 0 || io->res == -ECANCELED)) {
+		if (loop->backend->recv(loop->poll, io) == 0) {
+			r->reading = 1;
+		} else {
+			eventloop.ready(loop, &sock->ev, EVMASK_ERROR);
+		}
+	}
+	ring_settle(sock);
+}
+
+static void _sock_wrote(eventio_t *io) {
+	socket_t *sock = io->ud;
+	eventloop_t *loop = sock->loop;
+
+	sock->ring->writing = 0;
+	if (io->res > 0) {
+		buffer.read(stream.buffer(sock->ostm), 0, io->res);
+		sock->wbytes += io->res;
+		sock->wactive = eventloop.now(loop);
+		if (ring_write(sock)) {
+			io->res = -errno;
+		}
+	}
+	if (io->res <= 0 && io->res != -ECANCELED && ring_live(sock)) {
+		eventloop.ready(loop, &sock->ev, EVMASK_ERROR);
+	}
+	ring_settle(sock);
+}
 
-	sock->cb(sock, ev->mask, ev->ud);
+/* On a backend doing it's own I/O the fd is not polled, a multishot recv
+ * fills the input buffer and output leaves in a writev queued with the
+ * next poll, so an echo costs one syscall. A ring as input buffer could
+ * not stop the recv when full, such sockets are polled. */
+static int ring_attach(socket_t *sock) {
+	struct _sockring *r = sock->ring;
+	eventloop_t *loop = sock->loop;
+
+	if (!loop->backend->recv || loop->shared || buffer.capacity(stream.buffer(sock->istm))) {
+		return -1;
+	}
+	if (!r) {
+		r = pool.alloc(sizeof *r);
+		if (!r) {
+			return -1;
+		}
+		r->rio.fd = r->wio.fd = sock->ev.fd;
+		r->rio.cb = _sock_recv;
+		r->wio.cb = _sock_wrote;
+		r->rio.ud = r->wio.ud = sock;
+	}
+	/* the recv of an earlier enable may still wait for it's cancel. */
+	if (!r->reading) {
+		if (loop->backend->recv(loop->poll, &r->rio)) {
+			if (!sock->ring) {
+				pool.put(r);
+				return -1;
+			}
+			eventloop.ready(loop, &sock->ev, EVMASK_ERROR);
+		} else {
+			r->reading = 1;
+		}
+	}
+	sock->ring = r;
+	sock->ev.mask = EVMASK_NONE;
+	stream.hold(sock->istm, 1);
+	stream.hold(sock->ostm, 1);
+	if (buffer.avail(stream.buffer(sock->istm))) {
+		eventloop.ready(loop, &sock->ev, EVMASK_READ);
+	}
+	if (ring_write(sock)) {
+		eventloop.ready(loop, &sock->ev, EVMASK_ERROR);
+	}
+	return 0;
 }
 
 static socket_t *socket_new_from_fd(int fd, const sockaddr_t *sockname, const sockaddr_t *peername) {
-	socket_t *sock = alloc(0, sizeof *sock);
+	socket_t *sock = pool.alloc(sizeof *sock);
 	if (!sock) {
 		return 0;
 	}
 	event.init(&sock->ev, fd, EVMASK_NONE, _sock_dispatch, 0);
+	timewheel.init(&sock->to, _sock_timeout, sock);
 	sock->istm = stream.open_fd(fd, 0, 0);
 	sock->ostm = stream.open_fd(fd, 0, 0);
 	if (!sock->istm || !sock->ostm) {
-		alloc(sock, 0);
+		if (sock->istm) {
+			stream.free(sock->istm);
+		}
+		if (sock->ostm) {
+			stream.free(sock->ostm);
+		}
+		pool.put(sock);
 		return 0;
 	}
 	if (sockname) {
@@ -64,17 +429,122 @@ static socket_t *socket_new_from_fd(int fd, const sockaddr_t *sockname, const so
 	return sock;
 }
 
+static int socket_attach(socket_t *sock, int64_t now) {
+	sock->enabled = 1;
+	__sync_add_and_fetch(&sock->loop->nsocks, 1);
+	sock->ev.mask = EVMASK_READ;
+	if (buffer.avail(stream.buffer(sock->ostm))) {
+		sock->ev.mask |= EVMASK_WRITE;
+	}
+	socket_arm(sock, now);
+	if (ring_attach(sock) == 0) {
+		return 0;
+	}
+	if (sock->ring) {
+		/* moved to a polling backend, the move waited for the ring. */
+		pool.put(sock->ring);
+		sock->ring = 0;
+		stream.hold(sock->istm, 0);
+		stream.hold(sock->ostm, 0);
+	}
+	return eventloop.apply(sock->loop, &sock->ev);
+}
+
+static int socket_detach(socket_t *sock) {
+	sock->enabled = 0;
+	__sync_sub_and_fetch(&sock->loop->nsocks, 1);
+	if (sock->ev.rmask & EVMASK_FLUSH) {
+		try_write(sock);
+	}
+	sock->ev.mask = EVMASK_NONE;
+	eventloop.cancel(sock->loop, &sock->to);
+	if (sock->ring) {
+		/* a queued write goes out before the caller may close the fd. */
+		if (sock->ring->reading) {
+			sock->loop->backend->cancel(sock->loop->poll, &sock->ring->rio);
+		}
+		sock->loop->backend->submit(sock->loop->poll);
+	}
+	return eventloop.apply(sock->loop, &sock->ev);
+}
+
 static int socket_enable(socket_t *sock, int enable) {
 	if (sock->enabled == enable) {
 		return 0;
 	}
-	sock->enabled = enable;
 	if (enable) {
-		sock->ev.mask = EVMASK_READ;
-	} else {
-		sock->ev.mask = EVMASK_NONE;
+		sock->ractive = sock->wactive = eventloop.now(sock->loop);
+		return socket_attach(sock, sock->ractive);
 	}
-	return eventloop.apply(sock->loop, &sock->ev);
+	return socket_detach(sock);
+}
+
+static void _sock_migrated(eventloop_t *loop, void *ud) {
+	socket_t *sock = ud;
+	if (socket_attach(sock, eventloop.now(sock->loop))) {
+		sock->cb(sock, EVMASK_ERROR, sock->ev.ud);
+	}
+	(void)loop;
+}
+
+/* The socket belongs to no loop between the detach and the task, the
+ * fd is added edge triggered on the new loop, which reports any data
+ * left unread in the kernel. The deadlines keep their activity stamps. */
+static int socket_migrate(socket_t *sock, eventloop_t *to) {
+	eventloop_t *from = sock->loop;
+
+	if (to == from) {
+		return 0;
+	}
+	if (from->shared || to->shared) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	if (sock->dispatching) {
+		sock->moving = to;
+		return 0;
+	}
+	if (ring_busy(sock)) {
+		sock->moving = to;
+		ring_cancel(sock);
+		return 0;
+	}
+	if (from->hot == &sock->ev) {
+		from->hot = 0;
+		from->hot_cpu = 0;
+	}
+	sock->flushed = 0;
+	if (!sock->enabled) {
+		sock->loop = to;
+		return 0;
+	}
+	/* set while detaching, so no ring write starts on this loop. */
+	sock->moving = to;
+	socket_detach(sock);
+	sock->moving = 0;
+	sock->loop = to;
+	if (eventloop.post(to, _sock_migrated, sock)) {
+		int err = errno;
+		sock->loop = from;
+		socket_attach(sock, eventloop.now(sock->loop));
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+static int socket_flush(socket_t *sock) {
+	if (sock->loop->shared || (sock->write_through && sock->flushed != sock->loop->iteration + 1)) {
+		sock->flushed = sock->loop->iteration + 1;
+		if (try_write(sock)) {
+			return -1;
+		}
+		sock->wactive = eventloop.now(sock->loop);
+		socket_interest(sock);
+		return 0;
+	}
+	eventloop.ready(sock->loop, &sock->ev, EVMASK_FLUSH);
+	return 0;
 }
 
 static int socket_shutdown(socket_t *sock, int how) {
@@ -82,9 +552,32 @@ static int socket_shutdown(socket_t *sock, int how) {
 }
 
 static void socket_free(socket_t *sock) {
+	if (sock->dispatching) {
+		sock->freed = 1;
+		return;
+	}
+	if (timewheel.pending(&sock->to)) {
+		eventloop.cancel(sock->loop, &sock->to);
+	}
+	if (sock->loop) {
+		eventloop.detach(sock->loop, &sock->ev);
+	}
+	if (sock->loop && sock->loop->hot == &sock->ev) {
+		sock->loop->hot = 0;
+		sock->loop->hot_cpu = 0;
+	}
+	if (ring_busy(sock)) {
+		/* the ring still uses the buffers, the last completion frees. */
+		sock->freed = 1;
+		ring_cancel(sock);
+		return;
+	}
+	if (sock->ring) {
+		pool.put(sock->ring);
+	}
 	stream.free(sock->istm);
 	stream.free(sock->ostm);
-	alloc(sock, 0);
+	pool.put(sock);
 }
 
 
@@ -118,6 +611,8 @@ struct socket_ socket_ = {
 	socket_new_from_fd,
 	socket_free,
 	socket_enable,
+	socket_migrate,
+	socket_flush,
 	socket_shutdown,
 	socket_nonblock,
 	socket_for_addr
@@ -17,15 +17,29 @@ extern "C"{
 #define SOCK_SHUT_RDWR		2
 
 
+struct _sockring;
 typedef struct _socket socket_t;
 typedef void (*socket_pt)(socket_t *sock, int why, void *ud);
 struct _socket {
 	event_t ev;
 	eventloop_t *loop;
 	stream_t *istm, *ostm;
-	uint32_t timeout;
+	uint32_t timeout;	/* idle deadline in ms, 0 disable. */
+	uint32_t rtimeout;	/* read deadline in ms, 0 disable. */
+	uint32_t wtimeout;	/* write deadline in ms while output is queued, 0 disable. */
+	int64_t ractive, wactive;
+	timeout_t to;
 	socket_pt cb;
 	int enabled;
+	int write_through;	/* flush at once the first output of an iteration. */
+	uint64_t flushed;
+	int dispatching, freed;	/* free and migrate are deferred while dispatching. */
+	eventloop_t *moving;
+	uint64_t rbytes, wbytes;	/* bytes read from and written to the fd. */
+	int64_t cpu;	/* us spent in callbacks while the loop was accounting. */
+	uint64_t epoch;
+	int64_t wcpu;	/* cpu of the loop's current accounting epoch. */
+	struct _sockring *ring;	/* the loop's backend does the I/O, see enable. */
 	sockaddr_t sockname, peername;
 };
 
@@ -34,12 +48,47 @@ extern struct socket_ {
 	/** Create a new sock object from a socket descriptor. */
 	socket_t *(*new)(int fd, const sockaddr_t *sockname, const sockaddr_t *peername);
 
-	/** Release all resources associated with a socket object. */
+	/** Release all resources associated with a socket object, deferred
+	 *  until it's callback returned when called from there. Ring I/O in
+	 *  flight is cancelled and the memory released once it completed. */
 	void (*free)(socket_t *sock);
 
-	/** Enable or disable IO dispatching for a socket object. */
+	/** Enable or disable IO dispatching for a socket object.
+	 *  Enabling also arms the deadlines, which expire on the loop thread
+	 *  as a EVMASK_TIME callback. Sockets of a shared loop have no
+	 *  deadlines and flush at once.
+	 *
+	 *  On a backend with it's own I/O, like eventpoll_uring, the fd is not
+	 *  polled: arrivals are received into the input buffer and output is
+	 *  written from the output buffer by the ring, both streams are held
+	 *  meanwhile, see stream.hold. A socket with a ring as input buffer is
+	 *  polled.
+	 */
 	int (*enable)(socket_t *sock, int enable);
 
+	/**
+	 * Move a socket with it's streams and deadlines to another loop.
+	 *
+	 * Call on the thread of sock->loop, the socket is enabled on the
+	 * target by a posted task, so output is flushed and no callback runs
+	 * in between. Called from the socket's own callback, the move happens
+	 * once the callback returned, ring I/O in flight is cancelled and the
+	 * move waits for it to complete. Return -1 with ENOTSUP for shared loops
+	 * and EAGAIN if the task ring of the target is full, the socket then
+	 * stays on it's loop.
+	 */
+	int (*migrate)(socket_t *sock, eventloop_t *to);
+
+	/**
+	 * Flush the output stream once the current loop iteration is done.
+	 *
+	 * Output of every handler that ran in the iteration is coalesced into a
+	 * single write. With write_through set, the first flush of an iteration
+	 * writes at once and only the ones after it are deferred. Disabling the
+	 * socket flushes pending output. Loop thread only.
+	 */
+	int (*flush)(socket_t *sock);
+
 	/** Perform a shutdown operation on a socket object. */
 	int (*shutdown)(socket_t *sock, int how);
 
@@ -1,6 +1,7 @@
 #include "_.h"
 #include "stream.h"
 #include "buffer.h"
+#include "pool.h"
 #include "lock.h"
 #include "event.h"
 
@@ -11,6 +12,7 @@
 #include <errno.h>
 
 #define STM_READALL_LEN	65535
+#define STM_IOV_MAX		16
 
 struct _stream {
 	void *io;
@@ -20,20 +22,21 @@ struct _stream {
 	lock_t lock;
 	const struct stream_funcs *funcs;
 	int last_err;
+	int held;
 };
 
 
 static stream_t *stream_new(void *io, int flags, uint32_t bufsize, const struct stream_funcs *funcs) {
 	stream_t *stm;
 
-	stm = alloc(0, sizeof *stm);
+	stm = pool.alloc(sizeof *stm);
 	if (!stm) {
 		return 0;
 	}
 	stm->lock = 0;
 	stm->buf = buffer.new(bufsize);
 	if (!stm->buf) {
-		alloc(stm, 0);
+		pool.put(stm);
 		errno = ENOMEM;
 		return 0;
 	}
@@ -45,9 +48,26 @@ static stream_t *stream_new(void *io, int flags, uint32_t bufsize, const struct
 }
 
 
+static int stream_set_ring(stream_t *stm, uint32_t size) {
+	buffer_t *ring;
+
+	if (buffer.avail(stm->buf)) {
+		errno = EBUSY;
+		return -1;
+	}
+	ring = buffer.new_ring(size);
+	if (!ring) {
+		return -1;
+	}
+	buffer.free(stm->buf);
+	stm->buf = ring;
+	return 0;
+}
+
+
 static void stream_free(stream_t *stm) {
 	buffer.free(stm->buf);
-	alloc(stm, 0);
+	pool.put(stm);
 }
 
 
@@ -181,18 +201,53 @@ static int stream_errno(stream_t *stm) {
 }
 
 
+/* A held stream leaves the io to it's owner, it behaves like a fd that
+ * is never ready. */
+static int stm_readv(stream_t *stm, const struct iovec *iov, int iovcnt, uint32_t *nread) {
+	if (stm->held) {
+		stm->last_err = EAGAIN;
+		return -1;
+	}
+	return stm->funcs->readv(stm, iov, iovcnt, nread);
+}
+
+
+static int stm_writev(stream_t *stm, const struct iovec *iov, int iovcnt, uint32_t *nwrote) {
+	if (stm->held) {
+		stm->last_err = EAGAIN;
+		return -1;
+	}
+	return stm->funcs->writev(stm, iov, iovcnt, nwrote);
+}
+
+
+/* Reads land in the buffer segments, the stack tail only catches what
+ * goes past the space of the last segment, or of a new one once it's
+ * full. */
 static int stream_fill(stream_t *stm, uint32_t *nread) {
 	char tmp[STM_READALL_LEN];
+	struct iovec vec[2];
+	uint32_t cnt, space = 0;
+	int i, n;
+
 	stream_lock(stm);
-	uint32_t space = buffer.space(stm->buf);
-	uint8_t *rbuf = buffer.wpos(stm->buf);
-
-	struct iovec vec[2] = {
-		{.iov_base = rbuf,	.iov_len = space},
-		{.iov_base = tmp, .iov_len = STM_READALL_LEN}
-	};
-	uint32_t cnt;
-	if (stm->funcs->readv(stm, vec, 2, &cnt)) {
+	n = buffer.wvec(stm->buf, vec, 1);
+	for (i = 0; i < n; i++) {
+		space += vec[i].iov_len;
+	}
+	/* a ring takes no more than it's space. */
+	if (!buffer.capacity(stm->buf)) {
+		vec[n].iov_base = tmp;
+		vec[n].iov_len = STM_READALL_LEN;
+		n++;
+	} else if (space == 0) {
+		stm->last_err = ENOBUFS;
+		stream_unlock(stm);
+		errno = ENOBUFS;
+		return -1;
+	}
+	if (stm_readv(stm, vec, n, &cnt)) {
+		buffer.write(stm->buf, 0, 0);
 		stream_unlock(stm);
 		errno = stream_errno(stm);
 		return -1;
@@ -201,7 +256,7 @@ static int stream_fill(stream_t *stm, uint32_t *nread) {
 		*nread = cnt;
 	}
 
-	buffer.write(stm->buf, 0, cnt);
+	buffer.write(stm->buf, 0, min(cnt, space));
 	if (cnt > space) {
 		buffer.write(stm->buf, tmp, cnt - space);
 	}
@@ -216,7 +271,9 @@ static int stream_read(stream_t *stm, void *buf, uint32_t len, uint32_t *nread)
 	uint32_t ret = 0, nr;
 
 	if (len == 0) {
-		*nread = 0;
+		if (nread) {
+			*nread = 0;
+		}
 		return 0;
 	}
 	stream_lock(stm);
@@ -225,25 +282,21 @@ static int stream_read(stream_t *stm, void *buf, uint32_t len, uint32_t *nread)
 	dest += nr;
 	len -= nr;
 	ret += nr;
-	if (len == 0) {
+	if (len == 0 || !buf) {
 		if (nread) {
 			*nread = ret;
 		}
 		stream_unlock(stm);
 		return 0;
 	}
-	if (!buf) {
-		return -1;
-	}
 	while (len > 0) {
 		uint32_t cnt;
-		uint32_t wavail = buffer.space(stm->buf);
-		uint8_t *wmem = buffer.wpos(stm->buf);
 		struct iovec iov[2] = {
-			{ .iov_base = dest, .iov_len = len - !!wavail },
-			{ .iov_base = wmem, .iov_len = wavail }
+			{ .iov_base = dest, .iov_len = len }
 		};
-		if (!stm->funcs->readv(stm, iov, 2, &cnt) || cnt == 0) {
+		int n = 1 + buffer.wvec(stm->buf, iov + 1, 1);
+		if (stm_readv(stm, iov, n, &cnt)) {
+			buffer.write(stm->buf, 0, 0);
 			if (ret) {
 				break;
 			}
@@ -251,11 +304,9 @@ static int stream_read(stream_t *stm, void *buf, uint32_t len, uint32_t *nread)
 			stream_unlock(stm);
 			return -1;
 		}
-		if (cnt > iov[0].iov_len) {
-			cnt -= iov[0].iov_len;
-			dest[len-1] = *wmem;
-			cnt = len;
-		}
+		/* what went past len is read ahead into the buffer. */
+		buffer.write(stm->buf, 0, cnt > len ? cnt - len : 0);
+		cnt = min(cnt, len);
 		ret += cnt;
 		dest += cnt;
 		len -= cnt;
@@ -269,11 +320,17 @@ static int stream_read(stream_t *stm, void *buf, uint32_t len, uint32_t *nread)
 }
 
 
+/* Buffered segments and the new bytes leave in one writev, whatever the
+ * fd didn't take on EAGAIN is appended to the buffer. */
 static int _stream_write(stream_t *stm, const char *buf, uint32_t len, uint32_t *nwrote) {
-	uint32_t towrite, ret;
-	struct iovec iovs[2];
-	struct iovec *iov = iovs;
-	int iovcnt = 2;
+	struct iovec iov[STM_IOV_MAX + 1];
+	uint32_t ret, avail, queued, done = 0;
+	int i, n;
+
+	/* a drained buffer holds no segment, a small write takes one. */
+	if (len && len < (1 << STM_BUF_SIZE_P) && !buffer.avail(stm->buf) && !buffer.space(stm->buf)) {
+		buffer.extend(stm->buf, len);
+	}
 	if (len && len < buffer.space(stm->buf)) {
 		buffer.write(stm->buf, buf, len);
 		if (nwrote) {
@@ -281,36 +338,45 @@ static int _stream_write(stream_t *stm, const char *buf, uint32_t len, uint32_t
 		}
 		return 0;
 	}
-	uint32_t ravail = buffer.avail(stm->buf);
-	iov[0].iov_base = buffer.rpos(stm->buf);
-	iov[0].iov_len = ravail;
-	iov[1].iov_base = (char *)buf;
-	iov[1].iov_len = len;
-	towrite = iov[0].iov_len + iov[1].iov_len;
 	for (;;) {
-		if (stm->funcs->writev(stm, iov, iovcnt, &ret)) {
-			errno = stream_errno(stm);
-			return -1;
+		avail = buffer.avail(stm->buf);
+		n = buffer.rvec(stm->buf, iov, STM_IOV_MAX);
+		for (i = 0, queued = 0; i < n; i++) {
+			queued += iov[i].iov_len;
 		}
-		if (ret == towrite) {
-			buffer.read(stm->buf, 0, ravail);
-			if (nwrote) {
-				*nwrote = len;
+		/* the new bytes follow only once every buffered byte is in iov. */
+		if (queued == avail && done < len) {
+			iov[n].iov_base = (char *)buf + done;
+			iov[n].iov_len = len - done;
+			n++;
+		}
+		if (n == 0) {
+			break;
+		}
+		if (stm_writev(stm, iov, n, &ret)) {
+			if (stream_errno(stm) == EAGAIN && len) {
+				uint32_t k = buffer.write(stm->buf, buf + done, len - done);
+				if (nwrote) {
+					*nwrote = done + k;
+				}
+				if (k == len - done) {
+					return 0;
+				}
+				/* a full ring keeps what fit. */
+				stm->last_err = ENOBUFS;
 			}
-			return 0;
+			errno = stream_errno(stm);
+			return -1;
 		}
-		towrite -= ret;
-		if (ret > iov[0].iov_len) {
-			buffer.read(stm->buf, 0, ravail);
-			ret -= iov[0].iov_len;
-			iovcnt--;
-			iov++;
-		} else if (iovcnt == 2) {
-			buffer.read(stm->buf, 0, ret);
+		buffer.read(stm->buf, 0, min(ret, avail));
+		if (ret > avail) {
+			done += ret - avail;
 		}
-		iov[0].iov_base = (char *)iov[0].iov_base + ret;
-		iov[0].iov_len -= ret;
 	}
+	if (nwrote) {
+		*nwrote = len;
+	}
+	return 0;
 }
 
 
@@ -331,6 +397,18 @@ static int stream_write(stream_t *stm, const char *buf, uint32_t len, uint32_t *
 }
 
 
+/* Slices are queued like small writes, the next flush sends them from
+ * the shared block along with the bytes around them. */
+static int stream_write_slice(stream_t *stm, slice_t *sl, uint32_t off, uint32_t len) {
+	int ret;
+
+	stream_lock(stm);
+	ret = buffer.append(stm->buf, sl, off, len);
+	stream_unlock(stm);
+	return ret;
+}
+
+
 static int stream_flush(stream_t *stm) {
 	stream_lock(stm);
 	if (buffer.avail(stm->buf)) {
@@ -365,24 +443,34 @@ static int stream_seek(stream_t *stm, int32_t delta, int whence, uint32_t *newpo
 }
 
 
-static uint32_t stream_vprintf(stream_t *stm, const char *fmt, va_list ap) {
+static uint32_t stream_vprintf(stream_t *stm, const char *format, va_list ap) {
+	return buffer.vprintf(stm->buf, format, ap);
+}
+
+
+static uint32_t stream_printf(stream_t *stm, const char *format, ...) {
 	uint32_t ret;
-	va_list cpy;
+	va_list ap;
 
-	va_copy(cpy, ap);
-	ret = buffer.vprintf(stm->buf, fmt, ap);
+	va_start(ap, format);
+	ret = stream_vprintf(stm, format, ap);
 	va_end(ap);
 
 	return ret;
 }
 
 
-static uint32_t stream_printf(stream_t *stm, const char *fmt, ...) {
+static uint32_t stream_vformat(stream_t *stm, const fmt_t *f, va_list ap) {
+	return buffer.vformat(stm->buf, f, ap);
+}
+
+
+static uint32_t stream_format(stream_t *stm, const fmt_t *f, ...) {
 	uint32_t ret;
 	va_list ap;
 
-	va_start(ap, fmt);
-	ret = stream_vprintf(stm, fmt, ap);
+	va_start(ap, f);
+	ret = stream_vformat(stm, f, ap);
 	va_end(ap);
 
 	return ret;
@@ -394,6 +482,11 @@ static void *stream_yield(stream_t *stm, const char *delim, uint32_t delim_len,
 }
 
 
+static void *stream_yield_any(stream_t *stm, const char *const *delims, int n, uint32_t *len, int *which) {
+	return buffer.yield_any(stm->buf, delims, n, len, which);
+}
+
+
 static void stream_set_mask(stream_t *stm, int mask) {
 	stm->need_mask = mask;
 }
@@ -409,8 +502,14 @@ static buffer_t *stream_buffer(stream_t *stm) {
 }
 
 
+static void stream_hold(stream_t *stm, int hold) {
+	stm->held = hold;
+}
+
+
 struct stream_ stream = {
 	stream_new,
+	stream_set_ring,
 	stream_free,
 	stream_close,
 	stream_fd_open,
@@ -420,13 +519,18 @@ struct stream_ stream = {
 	stream_errno,
 	stream_read,
 	stream_write,
+	stream_write_slice,
 	stream_fill,
 	stream_flush,
 	stream_seek,
 	stream_yield,
+	stream_yield_any,
 	stream_set_mask,
 	stream_get_mask,
 	stream_buffer,
 	stream_vprintf,
-	stream_printf
+	stream_printf,
+	stream_vformat,
+	stream_format,
+	stream_hold
 };
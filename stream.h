@@ -29,6 +29,11 @@ extern struct stream_ {
 	 */
 	stream_t *(*new)(void *io, int flags, uint32_t bufsize, const struct stream_funcs *funcs);
 
+	/** Replace the empty buffer of a stream with a ring of size bytes,
+	 *  see buffer.new_ring. fill fails with ENOBUFS once the ring is full
+	 *  and write keeps only what fits on EAGAIN. */
+	int (*set_ring)(stream_t *stm, uint32_t size);
+
 	/** Free a stream and it's buffer. */
 	void (*free)(stream_t *stm);
 
@@ -58,6 +63,11 @@ extern struct stream_ {
 	/** Write a memory to the stream. */
 	int (*write)(stream_t *stm, const char *buf, uint32_t len, uint32_t *nwrote);
 
+	/** Queue len bytes of a slice at off without copying them, they are
+	 *  written from the slice by the next flush, see buffer.append. Fails
+	 *  with ENOTSUP on a stream with a ring. */
+	int (*write_slice)(stream_t *stm, slice_t *sl, uint32_t off, uint32_t len);
+
 	/** Read ahead from stream to stream buffer. */
 	int (*fill)(stream_t *stm, uint32_t *nread);
 
@@ -73,6 +83,10 @@ extern struct stream_ {
 	/** Yield a memory from stream with delim. */
 	void *(*yield)(stream_t *stm, const char *delim, uint32_t delim_len, uint32_t *len);
 
+	/** Yield a memory from stream ended by any of n delims, see
+	 *  buffer.yield_any. */
+	void *(*yield_any)(stream_t *stm, const char *const *delims, int n, uint32_t *len, int *which);
+
 	/** Set stream mask. */
 	void (*set_mask)(stream_t *stm, int mask);
 
@@ -83,15 +97,26 @@ extern struct stream_ {
 	buffer_t *(*buffer)(stream_t *stm);
 
 	/** Vprintf a format string to the stream. */
-	uint32_t (*vprintf)(stream_t *stm, const char *fmt, va_list ap);
+	uint32_t (*vprintf)(stream_t *stm, const char *format, va_list ap);
 
 	/** Printf a format string to the stream. */
-	uint32_t (*printf)(stream_t *stm, const char *fmt, ...)
+	uint32_t (*printf)(stream_t *stm, const char *format, ...)
 #ifdef __GNUC__
 		__attribute__((format(printf, 2, 3)))
 #endif
 		;
 
+	/** Vprintf with a format parsed once, see buffer.vformat. */
+	uint32_t (*vformat)(stream_t *stm, const fmt_t *f, va_list ap);
+
+	/** Printf with a format parsed once, see buffer.format. */
+	uint32_t (*format)(stream_t *stm, const fmt_t *f, ...);
+
+	/** Hold or release the io of a stream. While held, reads and flush
+	 *  fail with EAGAIN and writes are buffered, the owner moves the
+	 *  bytes in and out of the buffer, see socket_.enable. */
+	void (*hold)(stream_t *stm, int hold);
+
 } stream;
 
 #ifdef __cplusplus
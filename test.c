@@ -36,16 +36,18 @@ static void ecprocessor(socket_t *sock, int why, void *ud) {
 	printf("fd:%d why :%d, %" PRIu32 ", space: %" PRIu32 "\n", sock->ev.fd, why, buffer.avail(stream.buffer(sock->istm)),
 			buffer.space(stream.buffer(sock->istm)));
 
-	uint32_t len = 0;
-	char *buf = stream.yield(sock->istm, "\r\n", 2, &len);
-	if (len > 0) {
+	uint32_t len = 0, n = 0;
+	char *buf;
+	while ((buf = stream.yield(sock->istm, "\r\n", 2, &len))) {
+		n++;
 		buf[len - 2] = 0;
 		printf("%" PRId64 " %s\n", timer.now(), buf);
 		stream.printf(sock->ostm, "%s\r\n", buf);
-		stream.flush(sock->ostm);
-	} else {
+	}
+	if (n == 0) {
 		printf("not find record\n");
 	}
+	socket_.flush(sock);
 }
 
 static void acceptor(listener_t *lstn, socket_t *sock) {
@@ -72,7 +74,7 @@ static void connected(connector_t *conct, int err, socket_t *sock) {
 	sock->loop = connector.loop(conct);
 	socket_.enable(sock, 1);
 	stream.printf(sock->ostm, "hello:%d\r\n", sock->ev.fd);
-	stream.flush(sock->ostm);
+	socket_.flush(sock);
 	connector.connect(conct);
 }
 
@@ -5,6 +5,10 @@
 #ifdef HAVE_PTHREAD_H
 #include <pthread.h>
 #endif
+#include <sched.h>
+#include <dirent.h>
+
+#define THREAD_SYSFS_CPU	"/sys/devices/system/cpu"
 
 #ifdef HAVE___THREAD
 __thread thread_t *__thread_self;
@@ -15,12 +19,15 @@ static pthread_once_t thread_once = PTHREAD_ONCE_INIT;
 
 struct _thread {
 	pthread_t tid;
+	int joinable;
 	char name[64];
 };
 
 struct _thread_boot_arg {
 	pthread_t tid;
 	thread_t *thrd;
+	const thread_attr_t *attr;
+	int err;
 	thread_pt runable;
 	void *ud;
 };
@@ -31,7 +38,7 @@ static void thread_free(void *ud) {
 	__thread_self = 0;
 #endif
 	thread_t *thrd = ud;
-	if (!thrd) {
+	if (!thrd || thrd->joinable) {
 		return;
 	}
 	alloc(thrd, 0);
@@ -74,31 +81,175 @@ static thread_t *thread_self(void) {
 }
 
 
+/* threads from thread.new keep their handle until joined. */
+static int thread_join(thread_t *thrd, void **retval) {
+	int ret = pthread_join(thrd->tid, retval);
+	if (ret == 0) {
+		alloc(thrd, 0);
+	}
+	return ret;
+}
+
+
+static int set_affinity(pthread_t tid, const int *cpus, int ncpus) {
+#ifdef HAVE_PTHREAD_SETAFFINITY_NP
+	cpu_set_t set;
+	int i;
+
+	CPU_ZERO(&set);
+	for (i = 0; i < ncpus; i++) {
+		if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+			return EINVAL;
+		}
+		CPU_SET(cpus[i], &set);
+	}
+	return pthread_setaffinity_np(tid, sizeof set, &set);
+#else
+	(void)tid;
+	(void)cpus;
+	(void)ncpus;
+	return ENOTSUP;
+#endif
+}
+
+
+static void set_name(thread_t *thrd, const char *name) {
+	snprintf(thrd->name, sizeof thrd->name, "%s", name ? name : "");
+#ifdef HAVE_PTHREAD_SETNAME_NP
+	if (name) {
+		char osname[16];
+		snprintf(osname, sizeof osname, "%s", name);
+		pthread_setname_np(thrd->tid, osname);
+	}
+#endif
+}
+
+
 static void *thread_boot(void *ud) {
 	struct _thread_boot_arg *arg = ud;
-	arg->thrd = thread_self();
+	thread_pt runable = arg->runable;
+	void *runud = arg->ud;
+	thread_t *thrd = thread_self();
+	thrd->joinable = 1;
+	set_name(thrd, arg->attr->name);
+	if (arg->attr->ncpus > 0) {
+		arg->err = set_affinity(thrd->tid, arg->attr->cpus, arg->attr->ncpus);
+	}
+	if (arg->err) {
+		(void)SYNC_SET(arg->thrd, thrd);
+		return 0;
+	}
+	(void)SYNC_SET(arg->thrd, thrd);
 
-	void *ret = arg->runable(arg->ud);
+	void *ret = runable(runud);
 	pthread_exit(NULL);
 	return ret;
 }
 
-static thread_t *thread_new(const char *name, thread_pt runable, void *ud) {
+static thread_t *thread_new_attr(const thread_attr_t *attr, thread_pt runable, void *ud) {
 	struct _thread_boot_arg arg;
 	arg.runable = runable;
 	arg.ud = ud;
+	arg.attr = attr;
+	arg.err = 0;
 	arg.thrd = 0;
 
-	pthread_create(&arg.tid, 0, thread_boot, &arg);
+	if (pthread_create(&arg.tid, 0, thread_boot, &arg)) {
+		return 0;
+	}
 
 	while (!SYNC_GET(arg.thrd)) {}
-	snprintf(arg.thrd->name, 64, name);
+	if (arg.err) {
+		thread_join(arg.thrd, 0);
+		errno = arg.err;
+		return 0;
+	}
 	return arg.thrd;
 }
 
+static thread_t *thread_new(const char *name, thread_pt runable, void *ud) {
+	thread_attr_t attr = {name, 0, 0};
+	return thread_new_attr(&attr, runable, ud);
+}
 
-static int thread_join(thread_t *thrd, void **retval) {
-	return pthread_join(thrd->tid, retval);
+
+static const char *thread_name(thread_t *thrd) {
+	return thrd->name;
+}
+
+
+static int thread_set_affinity(thread_t *thrd, const int *cpus, int ncpus) {
+	int err = set_affinity(thrd->tid, cpus, ncpus);
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return 0;
+}
+
+
+static int thread_cpu(void) {
+#ifdef HAVE_SCHED_GETCPU
+	return sched_getcpu();
+#else
+	return -1;
+#endif
+}
+
+
+/* sysfs links every cpu to it's node as cpuN/nodeM. */
+static int thread_node(int cpu) {
+	char path[64];
+	struct dirent *ent;
+	DIR *dir;
+	int node = 0;
+
+	snprintf(path, sizeof path, THREAD_SYSFS_CPU "/cpu%d", cpu);
+	dir = opendir(path);
+	if (!dir) {
+		return 0;
+	}
+	while ((ent = readdir(dir))) {
+		if (!strncmp(ent->d_name, "node", 4) && ent->d_name[4] >= '0' && ent->d_name[4] <= '9') {
+			node = atoi(ent->d_name + 4);
+			break;
+		}
+	}
+	closedir(dir);
+	return node;
+}
+
+
+static int cpu_online(int cpu) {
+	char path[64];
+	int fd, on = 1;
+	char c;
+
+	snprintf(path, sizeof path, THREAD_SYSFS_CPU "/cpu%d/online", cpu);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		return 1;
+	}
+	if (read(fd, &c, 1) == 1) {
+		on = c == '1';
+	}
+	close(fd);
+	return on;
+}
+
+
+static int thread_node_cpus(int node, int *cpus, int max) {
+	int cpu, n = 0, ncpu = sysconf(_SC_NPROCESSORS_CONF);
+
+	for (cpu = 0; cpu < ncpu; cpu++) {
+		if (cpu_online(cpu) && thread_node(cpu) == node) {
+			if (n < max) {
+				cpus[n] = cpu;
+			}
+			n++;
+		}
+	}
+	return n;
 }
 
 
@@ -106,6 +257,12 @@ struct thread_ thread = {
 	thread_init,
 	thread_uninit,
 	thread_new,
+	thread_new_attr,
 	thread_join,
-	thread_self
+	thread_self,
+	thread_name,
+	thread_set_affinity,
+	thread_cpu,
+	thread_node,
+	thread_node_cpus
 };
@@ -8,12 +8,46 @@ extern "C"{
 typedef struct _thread thread_t;
 typedef void *(*thread_pt)(void *);
 
+typedef struct _thread_attr {
+	const char *name;	/* the OS name keeps the first 15 chars. */
+	const int *cpus;	/* cpus the thread may run on. */
+	int ncpus;			/* 0 for no affinity. */
+} thread_attr_t;
+
 extern struct thread_ {
 	void (*init)(void);
 	void (*uninit)(void);
+
+	/** Create a thread, name is also set as the OS thread name. */
 	thread_t *(*new)(const char *name, thread_pt runable, void *ud);
+
+	/**
+	 * Create a thread named and pinned by attr.
+	 *
+	 * The name and the affinity are set on the new thread before runable
+	 * is called, so everything it allocates is first touched on it's cpus.
+	 * Return 0 if the affinity can't be set, with ENOTSUP where it's not
+	 * available.
+	 */
+	thread_t *(*new_attr)(const thread_attr_t *attr, thread_pt runable, void *ud);
+
 	int (*join)(thread_t *thrd, void **retval);
 	thread_t *(*self)(void);
+
+	/** Return the name given to thread.new, "" for other threads. */
+	const char *(*name)(thread_t *thrd);
+
+	/** Restrict a running thread to ncpus cpus. */
+	int (*set_affinity)(thread_t *thrd, const int *cpus, int ncpus);
+
+	/** Return the cpu the calling thread runs on, -1 if unknown. */
+	int (*cpu)(void);
+
+	/** Return the NUMA node of a cpu, 0 without NUMA information. */
+	int (*node)(int cpu);
+
+	/** Fill cpus with up to max cpus of a node, return how many it has. */
+	int (*node_cpus)(int node, int *cpus, int max);
 } thread;
 
 #ifdef __cplusplus
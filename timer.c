@@ -1,16 +1,94 @@
 #include "_.h"
 #include "timer.h"
 
-#include <sys/time.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define TIMER_HAVE_TSC	1
+#endif
+
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE	CLOCK_MONOTONIC
+#endif
+
+#define TSC_CALIBRATE_NS	10000000
+
+static struct {
+	int enabled;
+	uint64_t base;		/* tsc at calibration. */
+	int64_t base_ns;	/* CLOCK_MONOTONIC at calibration. */
+	double ns_per_tick;
+} tsc;
+
+
+static int64_t clock_nsec(clockid_t id) {
+	struct timespec ts;
+	clock_gettime(id, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t timer_nsec(void) {
+#ifdef TIMER_HAVE_TSC
+	if (tsc.enabled) {
+		return tsc.base_ns + (int64_t)((double)(__rdtsc() - tsc.base) * tsc.ns_per_tick);
+	}
+#endif
+	return clock_nsec(CLOCK_MONOTONIC);
+}
 
 static int64_t timer_now(void) {
-	int64_t t;
-	struct timeval tv;
-	gettimeofday(&tv, 0);
-	t = tv.tv_sec * 1000 + tv.tv_usec / 1000;
-	return t;
+	return timer_nsec() / 1000000;
+}
+
+static int64_t timer_usec(void) {
+	return timer_nsec() / 1000;
+}
+
+static int64_t timer_coarse(void) {
+	return clock_nsec(CLOCK_MONOTONIC_COARSE) / 1000000;
+}
+
+static int timer_tsc(int enable) {
+#ifdef TIMER_HAVE_TSC
+	unsigned a, b, c, d;
+	uint64_t t0, t1;
+	int64_t n0, n1;
+
+	if (!enable) {
+		tsc.enabled = 0;
+		return 0;
+	}
+	/* invariant tsc: CPUID.80000007H:EDX[8]. */
+	if (!__get_cpuid(0x80000007, &a, &b, &c, &d) || !(d & (1 << 8))) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	n0 = clock_nsec(CLOCK_MONOTONIC);
+	t0 = __rdtsc();
+	do {
+		n1 = clock_nsec(CLOCK_MONOTONIC);
+		t1 = __rdtsc();
+	} while (n1 - n0 < TSC_CALIBRATE_NS);
+	tsc.ns_per_tick = (double)(n1 - n0) / (double)(t1 - t0);
+	tsc.base = t1;
+	tsc.base_ns = n1;
+	tsc.enabled = 1;
+	return 0;
+#else
+	if (enable) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	return 0;
+#endif
 }
 
 struct timer_ timer = {
-	timer_now
+	timer_now,
+	timer_usec,
+	timer_nsec,
+	timer_coarse,
+	timer_tsc
 };
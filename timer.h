@@ -1,3 +1,14 @@
+/**
+ * #Timer
+ *
+ * Every clock here is monotonic and reads the same source, so values of
+ * now, usec and nsec can be compared after scaling. The source is
+ * clock_gettime(CLOCK_MONOTONIC), served by the vDSO on Linux, or the
+ * TSC once timer.tsc(1) succeeded. Loop handlers should prefer
+ * eventloop.now, which is read once per iteration.
+ *
+ */
+
 #ifndef TIMER_H
 #define TIMER_H
 
@@ -9,8 +20,31 @@ extern "C"{
 
 
 extern struct timer_ {
+	/** Return a monotonic clock in milliseconds. */
 	int64_t (*now)(void);
 
+	/** Return a monotonic clock in microseconds. */
+	int64_t (*usec)(void);
+
+	/** Return a monotonic clock in nanoseconds. */
+	int64_t (*nsec)(void);
+
+	/**
+	 * Return a monotonic clock in milliseconds, only as precise as the
+	 * kernel tick but cheaper than now. Not affected by timer.tsc.
+	 */
+	int64_t (*coarse)(void);
+
+	/**
+	 * Read the clock from the calibrated TSC, or back from the vDSO.
+	 *
+	 * Enabling calibrates the TSC against CLOCK_MONOTONIC for about 10ms,
+	 * call it before other threads read the clock. Return -1 with ENOTSUP
+	 * unless the cpu has an invariant TSC. The TSCs of all cpus must be
+	 * in sync, which holds for current single and dual socket x86 boxes.
+	 */
+	int (*tsc)(int enable);
+
 } timer;
 
 #ifdef __cplusplus
@@ -0,0 +1,191 @@
+#include "_.h"
+#include "timewheel.h"
+
+#define TW_NEAR_BITS	8
+#define TW_NEAR			(1 << TW_NEAR_BITS)
+#define TW_NEAR_MASK	(TW_NEAR - 1)
+#define TW_LEVEL_BITS	6
+#define TW_LEVEL		(1 << TW_LEVEL_BITS)
+#define TW_LEVEL_MASK	(TW_LEVEL - 1)
+#define TW_LEVELS		4
+#define TW_SPAN			((uint64_t)1 << (TW_NEAR_BITS + TW_LEVELS * TW_LEVEL_BITS))
+
+struct _timewheel {
+	uint64_t tick;
+	uint32_t count;
+	timeout_t *near[TW_NEAR];
+	timeout_t *level[TW_LEVELS][TW_LEVEL];
+};
+
+
+static void link_slot(timeout_t **slot, timeout_t *to) {
+	to->next = *slot;
+	if (to->next) {
+		to->next->prev = &to->next;
+	}
+	to->prev = slot;
+	*slot = to;
+}
+
+
+static void unlink_slot(timeout_t *to) {
+	*to->prev = to->next;
+	if (to->next) {
+		to->next->prev = to->prev;
+	}
+	to->next = 0;
+	to->prev = 0;
+}
+
+
+static void place(timewheel_t *tw, timeout_t *to) {
+	uint64_t e = to->expire;
+	int i;
+
+	if (e < tw->tick) {
+		e = tw->tick;
+	} else if (e - tw->tick >= TW_SPAN) {
+		e = tw->tick + TW_SPAN - 1;
+	}
+	if ((e | TW_NEAR_MASK) == (tw->tick | TW_NEAR_MASK)) {
+		link_slot(&tw->near[e & TW_NEAR_MASK], to);
+		return;
+	}
+	for (i = 0; i < TW_LEVELS - 1; i++) {
+		uint64_t mask = ((uint64_t)1 << (TW_NEAR_BITS + (i + 1) * TW_LEVEL_BITS)) - 1;
+		if ((e | mask) == (tw->tick | mask)) {
+			break;
+		}
+	}
+	link_slot(&tw->level[i][(e >> (TW_NEAR_BITS + i * TW_LEVEL_BITS)) & TW_LEVEL_MASK], to);
+}
+
+
+static timewheel_t *timewheel_new(uint64_t now) {
+	timewheel_t *tw = alloc(0, sizeof *tw);
+	if (!tw) {
+		return 0;
+	}
+	tw->tick = now;
+	return tw;
+}
+
+
+static void timewheel_free(timewheel_t *tw) {
+	alloc(tw, 0);
+}
+
+
+static void timewheel_init(timeout_t *to, timeout_pt cb, void *ud) {
+	to->next = 0;
+	to->prev = 0;
+	to->expire = 0;
+	to->cb = cb;
+	to->ud = ud;
+}
+
+
+static int timewheel_pending(timeout_t *to) {
+	return to->prev != 0;
+}
+
+
+static void timewheel_cancel(timewheel_t *tw, timeout_t *to) {
+	if (!to->prev) {
+		return;
+	}
+	unlink_slot(to);
+	tw->count--;
+}
+
+
+static void timewheel_add(timewheel_t *tw, timeout_t *to, uint64_t expire) {
+	timewheel_cancel(tw, to);
+	if (expire <= tw->tick) {
+		expire = tw->tick + 1;
+	}
+	to->expire = expire;
+	place(tw, to);
+	tw->count++;
+}
+
+
+static int64_t timewheel_next(timewheel_t *tw) {
+	uint32_t i, idx = tw->tick & TW_NEAR_MASK;
+
+	if (tw->count == 0) {
+		return -1;
+	}
+	for (i = idx + 1; i < TW_NEAR; i++) {
+		if (tw->near[i]) {
+			return i - idx;
+		}
+	}
+	return TW_NEAR - idx;
+}
+
+
+static void cascade(timewheel_t *tw) {
+	int i;
+	for (i = 0; i < TW_LEVELS; i++) {
+		uint32_t idx = (tw->tick >> (TW_NEAR_BITS + i * TW_LEVEL_BITS)) & TW_LEVEL_MASK;
+		timeout_t *to = tw->level[i][idx];
+		tw->level[i][idx] = 0;
+		while (to) {
+			timeout_t *next = to->next;
+			place(tw, to);
+			to = next;
+		}
+		if (idx != 0) {
+			break;
+		}
+	}
+}
+
+
+static void fire(timewheel_t *tw) {
+	timeout_t *list = tw->near[tw->tick & TW_NEAR_MASK];
+	if (!list) {
+		return;
+	}
+	tw->near[tw->tick & TW_NEAR_MASK] = 0;
+	list->prev = &list;
+	while (list) {
+		timeout_t *to = list;
+		unlink_slot(to);
+		tw->count--;
+		to->cb(to);
+	}
+}
+
+
+static void timewheel_update(timewheel_t *tw, uint64_t now) {
+	if (tw->count == 0) {
+		if (now > tw->tick) {
+			tw->tick = now;
+		}
+		return;
+	}
+	while (tw->tick < now) {
+		tw->tick++;
+		if ((tw->tick & TW_NEAR_MASK) == 0) {
+			cascade(tw);
+		}
+		fire(tw);
+		if (tw->count == 0) {
+			tw->tick = now;
+		}
+	}
+}
+
+
+struct timewheel_ timewheel = {
+	timewheel_new,
+	timewheel_free,
+	timewheel_init,
+	timewheel_add,
+	timewheel_cancel,
+	timewheel_pending,
+	timewheel_next,
+	timewheel_update
+};
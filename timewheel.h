@@ -0,0 +1,68 @@
+/**
+ * #Timewheel
+ *
+ * A hierarchical timing wheel with millisecond ticks.
+ * add, cancel and reschedule are O(1); expiring a timer
+ * costs at most one cascade per level.
+ *
+ *  near (256 slots, 1ms)  level0..3 (64 slots each)
+ * |______________________|______|______|______|______|
+ *  ms 0..255              2^14   2^20   2^26   2^32
+ *
+ */
+
+#ifndef TIMEWHEEL_H
+#define TIMEWHEEL_H
+
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"{
+#endif
+
+struct _timewheel;
+typedef struct _timewheel timewheel_t;
+
+typedef struct _timeout timeout_t;
+typedef void (*timeout_pt)(timeout_t *to);
+
+struct _timeout {
+	struct _timeout *next;
+	struct _timeout **prev;
+	uint64_t expire;
+	timeout_pt cb;
+	void *ud;
+};
+
+extern struct timewheel_ {
+	/** Create a timewheel whose current tick is now. */
+	timewheel_t *(*new)(uint64_t now);
+
+	/** Free the timewheel. pending timeouts are dropped, not fired. */
+	void (*free)(timewheel_t *tw);
+
+	/** Initialize a timeout node before it's first use. */
+	void (*init)(timeout_t *to, timeout_pt cb, void *ud);
+
+	/** Schedule a timeout at absolute tick expire, rescheduling it if pending. */
+	void (*add)(timewheel_t *tw, timeout_t *to, uint64_t expire);
+
+	/** Cancel a timeout, it is safe to cancel a timeout not pending. */
+	void (*cancel)(timewheel_t *tw, timeout_t *to);
+
+	/** Return 1 if the timeout is scheduled. */
+	int (*pending)(timeout_t *to);
+
+	/** Return ticks until the wheel needs an update, -1 if no timeout pending. */
+	int64_t (*next)(timewheel_t *tw);
+
+	/** Advance the wheel to now, firing every expired timeout. */
+	void (*update)(timewheel_t *tw, uint64_t now);
+
+} timewheel;
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // TIMEWHEEL_H
@@ -0,0 +1,530 @@
+#include "_.h"
+#include "eventpoll.h"
+#include "log.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+
+#define URING_ENTRIES	1024
+#define URING_TAG_CTL	1
+#define URING_TAG_IO	2
+#define URING_BUFS		128		/* provided recv buffers, a power of 2. */
+#define URING_BUF_SIZE	(16 * 1024)
+
+struct _eventpoll {
+	int ringfd;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned sq_entries;
+	struct io_uring_sqe *sqes;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_cqe *cqes;
+	void *sq_ring;
+	void *cq_ring;
+	size_t sq_len;
+	size_t cq_len;
+	size_t sqes_len;
+	unsigned tail;
+	unsigned submit;
+	struct io_uring_buf_ring *br;	/* 0 when the kernel has no provided buffer rings. */
+	char *bufs;
+	unsigned short br_tail;
+	event_t wakev;
+	dispatch_pt disp;
+	void *ud;
+};
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *p) {
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+	return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+
+static int uring_enter(eventpoll_t *poll, unsigned min_complete, int timeout) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	unsigned flags = 0;
+	int ret;
+
+	memset(&arg, 0, sizeof arg);
+	if (min_complete) {
+		flags |= IORING_ENTER_GETEVENTS;
+		if (timeout >= 0) {
+			ts.tv_sec = timeout / 1000;
+			ts.tv_nsec = (timeout % 1000) * 1000000LL;
+			arg.ts = (uint64_t)(uintptr_t)&ts;
+		}
+	}
+	flags |= IORING_ENTER_EXT_ARG;
+	ret = syscall(__NR_io_uring_enter, poll->ringfd, poll->submit, min_complete, flags, &arg, sizeof arg);
+	if (ret >= 0) {
+		poll->submit -= min((unsigned)ret, poll->submit);
+	} else if (errno == ETIME) {
+		ret = 0;
+	}
+	return ret;
+}
+
+
+static struct io_uring_sqe *uring_sqe(eventpoll_t *poll) {
+	unsigned head = __atomic_load_n(poll->sq_head, __ATOMIC_ACQUIRE);
+	struct io_uring_sqe *sqe;
+
+	if (poll->tail - head >= poll->sq_entries) {
+		uring_enter(poll, 0, 0);
+		head = __atomic_load_n(poll->sq_head, __ATOMIC_ACQUIRE);
+		if (poll->tail - head >= poll->sq_entries) {
+			return 0;
+		}
+	}
+	sqe = &poll->sqes[poll->tail & *poll->sq_mask];
+	memset(sqe, 0, sizeof *sqe);
+	poll->sq_array[poll->tail & *poll->sq_mask] = poll->tail & *poll->sq_mask;
+	poll->tail++;
+	poll->submit++;
+	__atomic_store_n(poll->sq_tail, poll->tail, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+
+static int uring_poll_add(eventpoll_t *poll, event_t *ev, unsigned events) {
+	struct io_uring_sqe *sqe = uring_sqe(poll);
+	if (!sqe) {
+		errno = EBUSY;
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = ev->fd;
+	sqe->len = IORING_POLL_ADD_MULTI;
+	sqe->poll32_events = events;
+	sqe->user_data = (uint64_t)(uintptr_t)ev;
+	return 0;
+}
+
+
+static int uring_poll_update(eventpoll_t *poll, event_t *ev, unsigned events) {
+	struct io_uring_sqe *sqe = uring_sqe(poll);
+	if (!sqe) {
+		errno = EBUSY;
+		return -1;
+	}
+	sqe->opcode = IORING_OP_POLL_REMOVE;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)ev;
+	if (events) {
+		sqe->len = IORING_POLL_UPDATE_EVENTS | IORING_POLL_ADD_MULTI;
+		sqe->poll32_events = events;
+	}
+	sqe->user_data = (uint64_t)(uintptr_t)ev | URING_TAG_CTL;
+	return 0;
+}
+
+
+/* Recv buffers are handed back as soon as the completion was delivered,
+ * so the ring only runs dry when more than URING_BUFS arrive in a poll. */
+static void uring_buf_put(eventpoll_t *poll, unsigned bid) {
+	struct io_uring_buf *b = &poll->br->bufs[poll->br_tail & (URING_BUFS - 1)];
+
+	b->addr = (uint64_t)(uintptr_t)(poll->bufs + (size_t)bid * URING_BUF_SIZE);
+	b->len = URING_BUF_SIZE;
+	b->bid = bid;
+	poll->br_tail++;
+	__atomic_store_n(&poll->br->tail, poll->br_tail, __ATOMIC_RELEASE);
+}
+
+
+static int uring_bufs_init(eventpoll_t *poll) {
+	struct io_uring_buf_reg reg;
+	size_t len = URING_BUFS * sizeof(struct io_uring_buf);
+	unsigned i;
+
+	poll->br = mmap(0, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (poll->br == MAP_FAILED) {
+		poll->br = 0;
+		return -1;
+	}
+	poll->bufs = alloc(0, (size_t)URING_BUFS * URING_BUF_SIZE);
+	memset(&reg, 0, sizeof reg);
+	reg.ring_addr = (uint64_t)(uintptr_t)poll->br;
+	reg.ring_entries = URING_BUFS;
+	reg.bgid = 0;
+	if (!poll->bufs || uring_register(poll->ringfd, IORING_REGISTER_PBUF_RING, &reg, 1)) {
+		munmap(poll->br, len);
+		poll->br = 0;
+		if (poll->bufs) {
+			alloc(poll->bufs, 0);
+			poll->bufs = 0;
+		}
+		return -1;
+	}
+	for (i = 0; i < URING_BUFS; i++) {
+		uring_buf_put(poll, i);
+	}
+	return 0;
+}
+
+
+static int uring_recv(eventpoll_t *poll, eventio_t *io) {
+	struct io_uring_sqe *sqe;
+
+	if (!poll->br) {
+		errno = ENOTSUP;
+		return -1;
+	}
+	sqe = uring_sqe(poll);
+	if (!sqe) {
+		errno = EBUSY;
+		return -1;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = io->fd;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = 0;
+	sqe->user_data = (uint64_t)(uintptr_t)io | URING_TAG_IO;
+	return 0;
+}
+
+
+static int uring_writev(eventpoll_t *poll, eventio_t *io, const struct iovec *iov, int iovcnt) {
+	struct io_uring_sqe *sqe = uring_sqe(poll);
+	if (!sqe) {
+		errno = EBUSY;
+		return -1;
+	}
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = io->fd;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = iovcnt;
+	sqe->user_data = (uint64_t)(uintptr_t)io | URING_TAG_IO;
+	return 0;
+}
+
+
+static int uring_cancel(eventpoll_t *poll, eventio_t *io) {
+	struct io_uring_sqe *sqe = uring_sqe(poll);
+	if (!sqe) {
+		errno = EBUSY;
+		return -1;
+	}
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->fd = -1;
+	sqe->addr = (uint64_t)(uintptr_t)io | URING_TAG_IO;
+	sqe->user_data = (uint64_t)(uintptr_t)io | URING_TAG_CTL;
+	return 0;
+}
+
+
+static int uring_submit(eventpoll_t *poll) {
+	if (!poll->submit) {
+		return 0;
+	}
+	return uring_enter(poll, 0, 0) < 0 ? -1 : 0;
+}
+
+
+/* A recv that ran out of buffers is armed again behind the buffers this
+ * poll hands back, the owner does not see it. */
+static void uring_complete(eventpoll_t *poll, eventio_t *io, int res, unsigned flags) {
+	unsigned bid = flags >> IORING_CQE_BUFFER_SHIFT;
+
+	if (res == -ENOBUFS && !(flags & IORING_CQE_F_MORE) && uring_recv(poll, io) == 0) {
+		return;
+	}
+	io->res = res;
+	io->more = !!(flags & IORING_CQE_F_MORE);
+	io->data = 0;
+	if (flags & IORING_CQE_F_BUFFER) {
+		io->data = poll->bufs + (size_t)bid * URING_BUF_SIZE;
+	}
+	io->cb(io);
+	if (flags & IORING_CQE_F_BUFFER) {
+		uring_buf_put(poll, bid);
+	}
+}
+
+
+static void wake_cb(struct _eventloop *loop, event_t *ev) {
+	(void)loop;
+	uint64_t on;
+	ssize_t n = read(ev->fd, &on, sizeof on);
+	if (n != sizeof on && errno != EAGAIN) {
+		logger.warn("wake_cb read error: %s\n", strerror(errno));
+	}
+}
+
+
+static void eventpoll_free(eventpoll_t *poll) {
+	if (poll->sqes) {
+		munmap(poll->sqes, poll->sqes_len);
+	}
+	if (poll->cq_ring && poll->cq_ring != poll->sq_ring) {
+		munmap(poll->cq_ring, poll->cq_len);
+	}
+	if (poll->sq_ring) {
+		munmap(poll->sq_ring, poll->sq_len);
+	}
+	if (poll->wakev.fd != -1) {
+		close(poll->wakev.fd);
+	}
+	close(poll->ringfd);
+	if (poll->br) {
+		munmap(poll->br, URING_BUFS * sizeof(struct io_uring_buf));
+	}
+	if (poll->bufs) {
+		alloc(poll->bufs, 0);
+	}
+	alloc(poll, 0);
+}
+
+
+static eventpoll_t *eventpoll_new(dispatch_pt f, void *ud) {
+	struct io_uring_params p;
+	eventpoll_t *poll = alloc(0, sizeof *poll);
+	if (!poll) {
+		return 0;
+	}
+	poll->wakev.fd = -1;
+
+	memset(&p, 0, sizeof p);
+	poll->ringfd = uring_setup(URING_ENTRIES, &p);
+	if (poll->ringfd == -1) {
+		alloc(poll, 0);
+		return 0;
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG)) {
+		errno = ENOSYS;
+		goto err;
+	}
+
+	poll->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	poll->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		poll->sq_len = poll->cq_len = max(poll->sq_len, poll->cq_len);
+	}
+	poll->sq_ring = mmap(0, poll->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			poll->ringfd, IORING_OFF_SQ_RING);
+	if (poll->sq_ring == MAP_FAILED) {
+		poll->sq_ring = 0;
+		goto err;
+	}
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		poll->cq_ring = poll->sq_ring;
+	} else {
+		poll->cq_ring = mmap(0, poll->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				poll->ringfd, IORING_OFF_CQ_RING);
+		if (poll->cq_ring == MAP_FAILED) {
+			poll->cq_ring = 0;
+			goto err;
+		}
+	}
+	poll->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+	poll->sqes = mmap(0, poll->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			poll->ringfd, IORING_OFF_SQES);
+	if (poll->sqes == MAP_FAILED) {
+		poll->sqes = 0;
+		goto err;
+	}
+
+	poll->sq_head = (unsigned *)((char *)poll->sq_ring + p.sq_off.head);
+	poll->sq_tail = (unsigned *)((char *)poll->sq_ring + p.sq_off.tail);
+	poll->sq_mask = (unsigned *)((char *)poll->sq_ring + p.sq_off.ring_mask);
+	poll->sq_array = (unsigned *)((char *)poll->sq_ring + p.sq_off.array);
+	poll->sq_entries = p.sq_entries;
+	poll->cq_head = (unsigned *)((char *)poll->cq_ring + p.cq_off.head);
+	poll->cq_tail = (unsigned *)((char *)poll->cq_ring + p.cq_off.tail);
+	poll->cq_mask = (unsigned *)((char *)poll->cq_ring + p.cq_off.ring_mask);
+	poll->cqes = (struct io_uring_cqe *)((char *)poll->cq_ring + p.cq_off.cqes);
+	poll->tail = *poll->sq_tail;
+	if (uring_bufs_init(poll)) {
+		logger.debug("uring: no provided buffer rings, sockets are polled\n");
+	}
+
+	poll->wakev.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (poll->wakev.fd == -1) {
+		goto err;
+	}
+	poll->disp = f;
+	poll->ud = ud;
+
+	event.init(&poll->wakev, poll->wakev.fd, EVMASK_READ, wake_cb, 0);
+	poll->wakev.label = "wakeup";
+	poll->wakev.last_mask = POLLIN;
+	if (uring_poll_add(poll, &poll->wakev, POLLIN)) {
+		goto err;
+	}
+
+	return poll;
+
+err:
+	eventpoll_free(poll);
+	return 0;
+}
+
+
+/* Interest changes are queued as SQEs and submitted together with the
+ * next wait, removals are submitted at once since the event may be freed
+ * as soon as this returns. */
+static int eventpoll_apply(eventpoll_t *poll, event_t *ev) {
+	int ret, newmask;
+
+	switch (ev->mask & (EVMASK_READ | EVMASK_WRITE)) {
+		case EVMASK_READ | EVMASK_WRITE:
+			newmask = POLLIN | POLLOUT;
+			break;
+		case EVMASK_READ:
+			newmask = POLLIN;
+			break;
+		case EVMASK_WRITE:
+			newmask = POLLOUT;
+			break;
+		case 0:
+		default:
+			newmask = 0;
+			break;
+	}
+	if (newmask == ev->last_mask) {
+		return 0;
+	}
+	if (newmask == 0) {
+		ret = uring_poll_update(poll, ev, 0);
+		if (ret == 0 && uring_enter(poll, 0, 0) < 0) {
+			ret = -1;
+		}
+	} else if (ev->last_mask) {
+		ret = uring_poll_update(poll, ev, newmask);
+	} else {
+		ret = uring_poll_add(poll, ev, newmask);
+	}
+	ev->last_mask = newmask;
+	return ret;
+}
+
+
+static void eventpoll_wakeup(eventpoll_t *poll) {
+	uint64_t on = 1;
+	ssize_t n = write(poll->wakev.fd, &on, sizeof on);
+	if (n != sizeof on) {
+		logger.warn("wakeup write error: %s\n", strerror(errno));
+	}
+}
+
+
+static int eventpoll_poll(eventpoll_t *poll, int timeout) {
+	unsigned head, tail;
+	int n = 0, mask;
+	event_t *ev;
+
+	head = *poll->cq_head;
+	tail = __atomic_load_n(poll->cq_tail, __ATOMIC_ACQUIRE);
+	if (uring_enter(poll, head == tail && timeout != 0, timeout) < 0) {
+		return -1;
+	}
+
+	head = *poll->cq_head;
+	tail = __atomic_load_n(poll->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; head++) {
+		struct io_uring_cqe *cqe = &poll->cqes[head & *poll->cq_mask];
+		uint64_t data = cqe->user_data;
+		int res = cqe->res;
+		unsigned flags = cqe->flags;
+
+		__atomic_store_n(poll->cq_head, head + 1, __ATOMIC_RELEASE);
+		if (data & URING_TAG_IO) {
+			uring_complete(poll, (eventio_t *)(uintptr_t)(data & ~(uint64_t)URING_TAG_IO), res, flags);
+			n++;
+			tail = __atomic_load_n(poll->cq_tail, __ATOMIC_ACQUIRE);
+			continue;
+		}
+		if (data & URING_TAG_CTL) {
+			if (res < 0 && res != -ENOENT && res != -EALREADY) {
+				logger.warn("uring poll update error: %s\n", strerror(-res));
+			}
+			continue;
+		}
+		if (res == -ECANCELED) {
+			continue;
+		}
+		ev = (event_t *)(uintptr_t)data;
+		if (!(flags & IORING_CQE_F_MORE) && ev->last_mask) {
+			/* the multishot poll was terminated, arm it again. */
+			int last = ev->last_mask;
+			ev->last_mask = 0;
+			if (uring_poll_add(poll, ev, last) == 0) {
+				ev->last_mask = last;
+			}
+		}
+		if (res < 0) {
+			mask = EVMASK_ERROR;
+		} else {
+			switch (res & (POLLIN | POLLOUT | POLLERR | POLLHUP)) {
+				case POLLIN:
+					mask = EVMASK_READ;
+					break;
+				case POLLOUT:
+					mask = EVMASK_WRITE;
+					break;
+				case POLLIN | POLLOUT:
+					mask = EVMASK_READ | EVMASK_WRITE;
+					break;
+				default:
+					mask = EVMASK_ERROR;
+			}
+		}
+		ev->fired = mask;
+		poll->disp(poll, ev, poll->ud);
+		n++;
+		tail = __atomic_load_n(poll->cq_tail, __ATOMIC_ACQUIRE);
+	}
+	return n;
+}
+
+
+struct eventpoll_ eventpoll_uring = {
+	eventpoll_new,
+	eventpoll_free,
+	eventpoll_apply,
+	eventpoll_wakeup,
+	eventpoll_poll,
+	uring_recv,
+	uring_writev,
+	uring_cancel,
+	uring_submit
+};
+
+#else
+
+static eventpoll_t *eventpoll_new(dispatch_pt f, void *ud) {
+	(void)f;
+	(void)ud;
+	errno = ENOSYS;
+	return 0;
+}
+
+struct eventpoll_ eventpoll_uring = {
+	eventpoll_new,
+	0,
+	0,
+	0,
+	0,
+	0,
+	0,
+	0,
+	0
+};
+
+#endif // HAVE_LINUX_IO_URING_H